@@ -17,6 +17,7 @@
  */
 
 #include "ssdpcm_block_funcs.h"
+#include <string.h>
 
 /* ------------------------------------------------------------------------- */
 inline sample_t
@@ -65,17 +66,254 @@ block_iterator_init_ (ssdpcm_block_iterator *iter, ssdpcm_block *block, sample_t
 	iter->sample_state = block->initial_sample;
 }
 
+// The decoders are compiled for AVX2 and SSE4.1 too, and the best version for the
+// running CPU is picked at load time.
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define DECODE_CLONES_ __attribute__((target_clones("avx2", "sse4.1", "default")))
+#else
+#define DECODE_CLONES_
+#endif
+
+// Samples decoded at once by the vectorized decoders.
+#define DECODE_LANES_ 8
+
+// The slopes of DECODE_LANES_ codewords are summed up in 32-bit lanes, so the slopes
+// must be smaller than this; those of 8 and 16-bit audio are much smaller. Decoders
+// that add the last decoded sample in 32-bit lanes too also need it to be smaller than
+// DECODE_SIMD_MAX_STATE_.
+#define DECODE_SIMD_MAX_SLOPE_ (1 << 27)
+#define DECODE_SIMD_MAX_STATE_ (1 << 30)
+
+typedef int32_t v8i32_ __attribute__((vector_size(32)));
+typedef uint32_t v8u32_ __attribute__((vector_size(32)));
+typedef int32_t v4i32_ __attribute__((vector_size(16)));
+typedef int16_t v8i16_ __attribute__((vector_size(16)));
+typedef uint8_t v8u8_ __attribute__((vector_size(8)));
+typedef sample_t v4s_ __attribute__((vector_size(4 * sizeof(sample_t)), aligned(sizeof(sample_t))));
+
+/* ------------------------------------------------------------------------- */
+// Stores the slopes of a block in a vector, for decode_lanes_() to look them up.
+// Returns false if the block can't be decoded with vector operations, because it has
+// more slopes than lanes or they're too large.
+static inline bool
+decode_simd_table_ (v8i32_ *table, const ssdpcm_block *block)
+{
+	unsigned int c;
+	
+	if (block->num_deltas > DECODE_LANES_)
+	{
+		return false;
+	}
+	*table = (v8i32_){0};
+	for (c = 0; c < block->num_deltas; c++)
+	{
+		if (block->slopes[c] >= DECODE_SIMD_MAX_SLOPE_ || block->slopes[c] <= -DECODE_SIMD_MAX_SLOPE_)
+		{
+			return false;
+		}
+		(*table)[c] = block->slopes[c];
+	}
+	return true;
+}
+
+/* ------------------------------------------------------------------------- */
+// Looks up the slopes of DECODE_LANES_ codewords with a shuffle, and sums them up with
+// a prefix scan, which gives each decoded sample relative to the last sample before
+// them.
+static inline __attribute__((always_inline)) void
+decode_lanes_ (v8i32_ *sum, const v8i32_ *table, const codeword_t *deltas)
+{
+	v8i32_ zero = {0};
+	v8i32_ codes;
+	int c;
+	
+	for (c = 0; c < DECODE_LANES_; c++)
+	{
+		codes[c] = deltas[c];
+	}
+	*sum = __builtin_shuffle(*table, codes);
+	// Lane j of each mask picks lane j - k of the sum, or 0 if there's none
+	*sum += __builtin_shuffle(zero, *sum, (v8i32_){0, 8, 9, 10, 11, 12, 13, 14});
+	*sum += __builtin_shuffle(zero, *sum, (v8i32_){0, 1, 8, 9, 10, 11, 12, 13});
+	*sum += __builtin_shuffle(zero, *sum, (v8i32_){0, 1, 2, 3, 8, 9, 10, 11});
+}
+
+/* ------------------------------------------------------------------------- */
+// Stores the lanes of a vector of decoded samples every stride samples.
+static inline __attribute__((always_inline)) void
+store_strided_u8_ (uint8_t *out, size_t stride, const v8u8_ *pcm)
+{
+	int c;
+	
+	for (c = 0; c < DECODE_LANES_; c++)
+	{
+		out[c * stride] = (*pcm)[c];
+	}
+}
+
+static inline __attribute__((always_inline)) void
+store_strided_s16_ (int16_t *out, size_t stride, const v8i16_ *pcm)
+{
+	int c;
+	
+	for (c = 0; c < DECODE_LANES_; c++)
+	{
+		out[c * stride] = (*pcm)[c];
+	}
+}
+
 /* ------------------------------------------------------------------------- */
 // ssdpcm_block_decode: Decodes an SSDPCM block into a sample buffer.
-void
+DECODE_CLONES_ void
 ssdpcm_block_decode (sample_t *out, ssdpcm_block *block)
 {
-	ssdpcm_block_iterator dec;
-	block_iterator_init_(&dec, block, out);
-	while (dec.index < dec.block->length)
+	const codeword_t *deltas = block->deltas;
+	size_t length = block->length;
+	sample_t sample_state = block->initial_sample;
+	v8i32_ table;
+	size_t i = 0;
+	
+	if (decode_simd_table_(&table, block))
+	{
+		for (; i + DECODE_LANES_ <= length; i += DECODE_LANES_)
+		{
+			// Each half is widened on its own, GCC doesn't do well with 512-bit vectors
+			// on AVX2
+			union { v8i32_ v; v4i32_ half[2]; } sum;
+			decode_lanes_(&sum.v, &table, &deltas[i]);
+			*(v4s_ *)&out[i] = __builtin_convertvector(sum.half[0], v4s_) + sample_state;
+			*(v4s_ *)&out[i + 4] = __builtin_convertvector(sum.half[1], v4s_) + sample_state;
+			sample_state += sum.v[DECODE_LANES_ - 1];
+		}
+	}
+	for (; i < length; i++)
+	{
+		sample_state += block->slopes[deltas[i]];
+		out[i] = sample_state;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_block_decode_u8: Decodes an SSDPCM block straight into unsigned 8-bit
+// samples, wrapping them around like sample_encode_u8_overflow() does. The samples
+// are stored every stride bytes, so stereo samples can be interleaved; each group of
+// samples decoded at once is then copied out one sample at a time.
+// Returns the last decoded sample, before wrapping it around.
+DECODE_CLONES_ sample_t
+ssdpcm_block_decode_u8 (uint8_t *out, size_t stride, ssdpcm_block *block)
+{
+	const codeword_t *deltas = block->deltas;
+	size_t length = block->length;
+	sample_t sample_state = block->initial_sample;
+	v8i32_ table;
+	size_t i = 0;
+	
+	if (decode_simd_table_(&table, block))
+	{
+		for (; i + DECODE_LANES_ <= length; i += DECODE_LANES_)
+		{
+			v8i32_ sum;
+			v8u32_ samples;
+			v8u8_ pcm;
+			
+			decode_lanes_(&sum, &table, &deltas[i]);
+			// Only the low 8 bits are kept, so the lanes can wrap around
+			samples = ((v8u32_)sum + (uint32_t)sample_state) & 0xFF;
+			// Narrowing to 16 bits first gives much better code on x86
+			pcm = __builtin_convertvector(__builtin_convertvector(samples, v8i16_), v8u8_);
+			if (stride == 1)
+			{
+				memcpy(&out[i], &pcm, sizeof(pcm));
+			}
+			else
+			{
+				store_strided_u8_(&out[i * stride], stride, &pcm);
+			}
+			sample_state += sum[DECODE_LANES_ - 1];
+		}
+	}
+	for (; i < length; i++)
+	{
+		sample_state += block->slopes[deltas[i]];
+		out[i * stride] = sample_state & 0xFF;
+	}
+	return sample_state;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_block_decode_s16: Decodes an SSDPCM block straight into signed 16-bit
+// samples, clamping them like sample_encode_s16() does. The samples are stored every
+// stride samples, so stereo samples can be interleaved, as in ssdpcm_block_decode_u8().
+// Returns the last decoded sample, before clamping it.
+DECODE_CLONES_ sample_t
+ssdpcm_block_decode_s16 (int16_t *out, size_t stride, ssdpcm_block *block)
+{
+	const codeword_t *deltas = block->deltas;
+	size_t length = block->length;
+	sample_t sample_state = block->initial_sample;
+	v8i32_ table;
+	size_t i = 0;
+	
+	if (decode_simd_table_(&table, block))
 	{
-		decode_one_sample_(&dec);
+		for (; i + DECODE_LANES_ <= length && sample_state < DECODE_SIMD_MAX_STATE_ && sample_state > -DECODE_SIMD_MAX_STATE_; i += DECODE_LANES_)
+		{
+			v8i32_ sum;
+			v8i32_ samples;
+			v8i32_ over;
+			v8i32_ under;
+			v8i16_ pcm;
+			
+			decode_lanes_(&sum, &table, &deltas[i]);
+			samples = sum + (int32_t)sample_state;
+			over = (samples > INT16_MAX);
+			under = (samples < INT16_MIN);
+			samples = (samples & ~over) | (INT16_MAX & over);
+			samples = (samples & ~under) | (INT16_MIN & under);
+			pcm = __builtin_convertvector(samples, v8i16_);
+			if (stride == 1)
+			{
+				memcpy(&out[i], &pcm, sizeof(pcm));
+			}
+			else
+			{
+				store_strided_s16_(&out[i * stride], stride, &pcm);
+			}
+			sample_state += sum[DECODE_LANES_ - 1];
+		}
 	}
+	for (; i < length; i++)
+	{
+		sample_t value;
+		sample_state += block->slopes[deltas[i]];
+		value = sample_state;
+		if (value > INT16_MAX)
+		{
+			value = INT16_MAX;
+		}
+		if (value < INT16_MIN)
+		{
+			value = INT16_MIN;
+		}
+		out[i * stride] = value;
+	}
+	return sample_state;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_block_sum: Returns the sum of the slopes picked by a block's codewords,
+// which is how far its last sample is from its initial sample once decoded.
+sample_t
+ssdpcm_block_sum (const ssdpcm_block *block)
+{
+	sample_t sum = 0;
+	size_t i;
+	
+	for (i = 0; i < block->length; i++)
+	{
+		sum += block->slopes[block->deltas[i]];
+	}
+	return sum;
 }
 
 /* ------------------------------------------------------------------------- */
@@ -99,13 +337,17 @@ find_best_delta_ (ssdpcm_encoder *enc)
 }
 
 /* ------------------------------------------------------------------------- */
-// ssdpcm_block_encode: Encodes an SSDPCM block (given preinitialized fields),
-// and given as input:
+// ssdpcm_block_encode_bounded: Encodes an SSDPCM block (given preinitialized
+// fields), and given as input:
 // - A sample buffer
-// - An error tracker (with preallocated state).
+// - An error tracker (with preallocated state)
+// - An error bound, usually the best error metric found so far by a search.
+// Since the accumulated error never decreases, encoding is abandoned as soon as
+// it reaches the bound; in that case the returned metric is a partial sum that's
+// no smaller than the bound, and the block's codewords are left incomplete.
 // Returns the accumulated error metric.
 uint64_t
-ssdpcm_block_encode (ssdpcm_block *block, sample_t *in, sigma_tracker *sigma)
+ssdpcm_block_encode_bounded (ssdpcm_block *block, sample_t *in, sigma_tracker *sigma, uint64_t error_bound)
 {
 	uint64_t error_metric;
 	ssdpcm_encoder enc;
@@ -117,7 +359,48 @@ ssdpcm_block_encode (ssdpcm_block *block, sample_t *in, sigma_tracker *sigma)
 		codeword_t best_delta = find_best_delta_(&enc);
 		enqueue_one_codeword_(&enc.iter, best_delta);
 		enc.sigma->methods->advance(&enc.sigma->state);
+		if (enc.sigma->methods->get_accumulated_error(&enc.sigma->state) >= error_bound)
+		{
+			break;
+		}
 	}
 	error_metric = enc.sigma->methods->get_accumulated_error(&enc.sigma->state);
 	return error_metric;
 }
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_block_encode: Encodes an SSDPCM block (given preinitialized fields),
+// and given as input:
+// - A sample buffer
+// - An error tracker (with preallocated state).
+// Returns the accumulated error metric.
+uint64_t
+ssdpcm_block_encode (ssdpcm_block *block, sample_t *in, sigma_tracker *sigma)
+{
+	return ssdpcm_block_encode_bounded(block, in, sigma, UINT64_MAX);
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_block_encode_batch_bounded: Encodes an SSDPCM block once for each of
+// a batch of candidate slope sets, given as input:
+// - A sample buffer
+// - An error tracker (with preallocated state)
+// - The candidate slope sets, stored one after the other, each with the block's
+//   number of deltas
+// - The number of candidates, up to SSDPCM_ENCODE_BATCH_SIZE
+// - An error bound, with the same meaning as in ssdpcm_block_encode_bounded().
+// The error metric of each candidate is stored in the errors array. The block's
+// slopes and codewords are overwritten.
+void
+ssdpcm_block_encode_batch_bounded (
+	ssdpcm_block *block, sample_t *in, sigma_tracker *sigma, const sample_t *slopes, size_t num_candidates, uint64_t error_bound, uint64_t *errors)
+{
+	size_t i;
+	
+	debug_assert(num_candidates <= SSDPCM_ENCODE_BATCH_SIZE);
+	for (i = 0; i < num_candidates; i++)
+	{
+		memcpy(block->slopes, &slopes[i * block->num_deltas], block->num_deltas * sizeof(sample_t));
+		errors[i] = ssdpcm_block_encode_bounded(block, in, sigma, error_bound);
+	}
+}
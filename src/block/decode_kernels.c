@@ -0,0 +1,276 @@
+/*
+ * ssdpcm: implementation of the SSDPCM audio codec designed by Algorithm.
+ * Copyright (C) 2022-2025 Kagamiin~
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "block.h"
+#include "ssdpcm_block_funcs.h"
+#include <string.h>
+
+// Fused block decoders, one for each SSDPCM mode and output sample format. They decode
+// a block straight from its code, as stored in the file, into output samples, giving
+// the same samples as unpacking the codewords with get_bits_msbfirst() or
+// range_decode_*(), decoding them with ssdpcm_block_decode() and converting them with
+// sample_encode_*() would.
+// The codewords are expanded from the code with lookup tables, a chunk at a time, into
+// a small buffer on the stack, which is decoded right away by
+// ssdpcm_block_decode_u8() or ssdpcm_block_decode_s16().
+
+// X(mode, mode_enum, codewords_per_byte, comb)
+// Modes whose codewords don't fit evenly in bytes have 0 codewords per byte.
+#define DECODE_KERNEL_MODES(X) \
+	X(ss1,   SS_SS1,   8, false) \
+	X(ss1c,  SS_SS1C,  8, true)  \
+	X(ss1_6, SS_SS1_6, 5, false) \
+	X(ss2,   SS_SS2,   4, false) \
+	X(ss2_3, SS_SS2_3, 0, false) \
+	X(ss3,   SS_SS3,   0, false)
+
+// X(format, s16)
+#define DECODE_KERNEL_FORMATS(X, ...) \
+	X(__VA_ARGS__, u8,  false) \
+	X(__VA_ARGS__, s16, true)
+
+// Codewords unpacked at once. It's a multiple of the number of codewords in a group of
+// bytes of every mode (8, 5, 4, 24 and 8 codewords), so every chunk starts at the start
+// of a group.
+#define DECODE_CHUNK_LENGTH 240
+
+// Lookup tables of the codewords in each byte of ss1, ss2 and ss1.6 codes, and in each
+// 7-bit number of ss2.3 codes, first codeword first, exactly as get_bits_msbfirst(),
+// range_decode_ss1_6() and range_decode_ss2_3() compute them. ss3 codes are made of
+// base-8 digits, which are just bit fields.
+#define REPEAT_4_(f, n) f(n) f((n) + 1) f((n) + 2) f((n) + 3)
+#define REPEAT_16_(f, n) REPEAT_4_(f, n) REPEAT_4_(f, (n) + 4) REPEAT_4_(f, (n) + 8) REPEAT_4_(f, (n) + 12)
+#define REPEAT_64_(f, n) REPEAT_16_(f, n) REPEAT_16_(f, (n) + 16) REPEAT_16_(f, (n) + 32) REPEAT_16_(f, (n) + 48)
+#define REPEAT_128_(f, n) REPEAT_64_(f, n) REPEAT_64_(f, (n) + 64)
+#define REPEAT_256_(f, n) REPEAT_128_(f, n) REPEAT_128_(f, (n) + 128)
+
+#define SS1_CODEWORDS_(n) {(n) >> 7 & 1, (n) >> 6 & 1, (n) >> 5 & 1, (n) >> 4 & 1, (n) >> 3 & 1, (n) >> 2 & 1, (n) >> 1 & 1, (n) & 1},
+#define SS2_CODEWORDS_(n) {(n) >> 6 & 3, (n) >> 4 & 3, (n) >> 2 & 3, (n) & 3},
+#define SS1_6_CODEWORDS_(n) {(n) / 81 % 3, (n) / 27 % 3, (n) / 9 % 3, (n) / 3 % 3, (n) % 3},
+#define SS2_3_CODEWORDS_(n) {(n) / 25 % 5, (n) / 5 % 5, (n) % 5},
+
+static const codeword_t ss1_codewords_[256][8] = {REPEAT_256_(SS1_CODEWORDS_, 0)};
+static const codeword_t ss2_codewords_[256][4] = {REPEAT_256_(SS2_CODEWORDS_, 0)};
+static const codeword_t ss1_6_codewords_[256][5] = {REPEAT_256_(SS1_6_CODEWORDS_, 0)};
+static const codeword_t ss2_3_codewords_[128][3] = {REPEAT_128_(SS2_3_CODEWORDS_, 0)};
+
+/* ------------------------------------------------------------------------- */
+// Unpacks the codewords of the given bytes of an ss1 code.
+// Returns the number of codewords unpacked.
+static inline __attribute__((always_inline)) size_t
+unpack_ss1_ (codeword_t *deltas, const uint8_t *code, size_t code_size)
+{
+	size_t i;
+	
+	for (i = 0; i < code_size; i++)
+	{
+		memcpy(&deltas[i * 8], ss1_codewords_[code[i]], 8 * sizeof(codeword_t));
+	}
+	return code_size * 8;
+}
+
+#define unpack_ss1c_ unpack_ss1_
+
+/* ------------------------------------------------------------------------- */
+// Same as unpack_ss1_(), for ss1.6 codes.
+static inline __attribute__((always_inline)) size_t
+unpack_ss1_6_ (codeword_t *deltas, const uint8_t *code, size_t code_size)
+{
+	size_t i;
+	
+	for (i = 0; i < code_size; i++)
+	{
+		memcpy(&deltas[i * 5], ss1_6_codewords_[code[i]], 5 * sizeof(codeword_t));
+	}
+	return code_size * 5;
+}
+
+/* ------------------------------------------------------------------------- */
+// Same as unpack_ss1_(), for ss2 codes.
+static inline __attribute__((always_inline)) size_t
+unpack_ss2_ (codeword_t *deltas, const uint8_t *code, size_t code_size)
+{
+	size_t i;
+	
+	for (i = 0; i < code_size; i++)
+	{
+		memcpy(&deltas[i * 4], ss2_codewords_[code[i]], 4 * sizeof(codeword_t));
+	}
+	return code_size * 4;
+}
+
+/* ------------------------------------------------------------------------- */
+// Same as unpack_ss1_(), for ss2.3 codes. Every 7 bytes hold 8 numbers: one in the
+// upper 7 bits of each byte, and the last one in their lowest bits.
+static inline __attribute__((always_inline)) size_t
+unpack_ss2_3_ (codeword_t *deltas, const uint8_t *code, size_t code_size)
+{
+	size_t i = 0;
+	size_t n = 0;
+	
+	while (i < code_size)
+	{
+		uint8_t num_7 = 0;
+		size_t j;
+		
+		for (j = 0; j < 7 && i < code_size; j++, i++, n += 3)
+		{
+			memcpy(&deltas[n], ss2_3_codewords_[code[i] >> 1], 3 * sizeof(codeword_t));
+			num_7 |= (code[i] & 0x01) << j;
+		}
+		if (j == 7)
+		{
+			memcpy(&deltas[n], ss2_3_codewords_[num_7], 3 * sizeof(codeword_t));
+			n += 3;
+		}
+	}
+	return n;
+}
+
+/* ------------------------------------------------------------------------- */
+// Same as unpack_ss1_(), for ss3 codes. Every 3 bytes hold 4 numbers: one in the upper
+// 6 bits of each byte, and the last one in their lowest 2 bits.
+static inline __attribute__((always_inline)) size_t
+unpack_ss3_ (codeword_t *deltas, const uint8_t *code, size_t code_size)
+{
+	size_t i = 0;
+	size_t n = 0;
+	
+	while (i < code_size)
+	{
+		uint8_t num_3 = 0;
+		size_t j;
+		
+		for (j = 0; j < 3 && i < code_size; j++, i++, n += 2)
+		{
+			deltas[n] = code[i] >> 5;
+			deltas[n + 1] = (code[i] >> 2) & 0x07;
+			num_3 |= (code[i] & 0x03) << (2 * j);
+		}
+		if (j == 3)
+		{
+			deltas[n] = num_3 >> 3;
+			deltas[n + 1] = num_3 & 0x07;
+			n += 2;
+		}
+	}
+	return n;
+}
+
+/* ------------------------------------------------------------------------- */
+// Decodes a block with the comb filter applied, like ssdpcm_block_decode() followed by
+// sample_filter_comb() and sample_encode_*() would.
+// Returns the last decoded sample, before filtering it.
+static inline __attribute__((always_inline)) sample_t
+decode_comb_ (void *out, size_t stride, const ssdpcm_block *block, const bool s16)
+{
+	sample_t sample_state = block->initial_sample;
+	size_t i;
+	
+	for (i = 0; i < block->length; i++)
+	{
+		sample_t previous = sample_state;
+		sample_t value;
+		
+		sample_state += block->slopes[block->deltas[i]];
+		value = (previous + sample_state) / 2;
+		if (s16)
+		{
+			if (value > INT16_MAX)
+			{
+				value = INT16_MAX;
+			}
+			if (value < INT16_MIN)
+			{
+				value = INT16_MIN;
+			}
+			((int16_t *)out)[i * stride] = value;
+		}
+		else
+		{
+			((uint8_t *)out)[i * stride] = value & 0xFF;
+		}
+	}
+	return sample_state;
+}
+
+// Bytes of code unpacked into each chunk, given the number of codewords per byte, or
+// 0 for ss2.3 and ss3, which have 24 codewords every 7 bytes and 8 every 3 bytes.
+#define DECODE_CHUNK_BYTES_(mode, codewords_per_byte) \
+	((codewords_per_byte) ? DECODE_CHUNK_LENGTH / (codewords_per_byte) : \
+	 (mode) == SS_SS2_3 ? DECODE_CHUNK_LENGTH / 24 * 7 : DECODE_CHUNK_LENGTH / 8 * 3)
+
+#define DEFINE_DECODE_KERNEL_(mode, mode_enum, codewords_per_byte, comb, format, s16) \
+static sample_t \
+ssdpcm_block_decode_packed_##mode##_##format (void *out, size_t stride, const uint8_t *code, size_t code_size, const ssdpcm_block *block) \
+{ \
+	codeword_t deltas[DECODE_CHUNK_LENGTH]; \
+	ssdpcm_block chunk = *block; \
+	size_t chunk_bytes = DECODE_CHUNK_BYTES_(mode_enum, codewords_per_byte); \
+	size_t done = 0; \
+	\
+	chunk.deltas = deltas; \
+	while (done < block->length && code_size > 0) \
+	{ \
+		size_t bytes = code_size < chunk_bytes ? code_size : chunk_bytes; \
+		size_t unpacked = unpack_##mode##_(deltas, code, bytes); \
+		chunk.length = unpacked < block->length - done ? unpacked : block->length - done; \
+		if (comb) \
+		{ \
+			chunk.initial_sample = decode_comb_((s16 ? (void *)((int16_t *)out + done * stride) : (void *)((uint8_t *)out + done * stride)), stride, &chunk, s16); \
+		} \
+		else if (s16) \
+		{ \
+			chunk.initial_sample = ssdpcm_block_decode_s16((int16_t *)out + done * stride, stride, &chunk); \
+		} \
+		else \
+		{ \
+			chunk.initial_sample = ssdpcm_block_decode_u8((uint8_t *)out + done * stride, stride, &chunk); \
+		} \
+		done += chunk.length; \
+		code += bytes; \
+		code_size -= bytes; \
+	} \
+	debug_assert(done == block->length); \
+	return chunk.initial_sample; \
+}
+
+#define DEFINE_DECODE_KERNELS_(mode, mode_enum, codewords_per_byte, comb) \
+	DECODE_KERNEL_FORMATS(DEFINE_DECODE_KERNEL_, mode, mode_enum, codewords_per_byte, comb)
+
+DECODE_KERNEL_MODES(DEFINE_DECODE_KERNELS_)
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_block_decode_packed_select: Picks the fused block decoder for the given mode
+// and output sample format.
+// Returns NULL if there's none for that combination.
+ssdpcm_block_decode_packed_func
+ssdpcm_block_decode_packed_select (ssdpcm_block_mode mode, wav_sample_fmt format)
+{
+#define SELECT_DECODE_KERNEL_(mode_name, mode_enum, codewords_per_byte, comb, format_name, s16) \
+	if (mode == mode_enum && format == (s16 ? W_S16LE : W_U8)) \
+	{ \
+		return &ssdpcm_block_decode_packed_##mode_name##_##format_name; \
+	}
+#define SELECT_DECODE_KERNELS_(mode_name, mode_enum, codewords_per_byte, comb) \
+	DECODE_KERNEL_FORMATS(SELECT_DECODE_KERNEL_, mode_name, mode_enum, codewords_per_byte, comb)
+	
+	DECODE_KERNEL_MODES(SELECT_DECODE_KERNELS_)
+	
+	return NULL;
+}
@@ -0,0 +1,370 @@
+/*
+ * ssdpcm: implementation of the SSDPCM audio codec designed by Algorithm.
+ * Copyright (C) 2022-2025 Kagamiin~
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "ssdpcm_block_funcs.h"
+#include <string.h>
+
+// Specialized block encoders, one for each error tracker and slope count used by the
+// SSDPCM modes. They compute exactly the same codewords and error metric as
+// ssdpcm_block_encode_bounded() does with the corresponding sigma tracker, but with the
+// error calculation inlined, the decoder state kept in locals and the codeword loop
+// unrolled by the compiler.
+
+// X(tracker, mask, overflow_shift, comb)
+// A mask of 0 means that the tracker doesn't wrap samples around; otherwise, the error
+// of an overflowing sample is multiplied by (1 << overflow_shift).
+#define ENCODE_KERNEL_TRACKERS(X) \
+	X(generic,          0x00, 0, false) \
+	X(generic_comb,     0x00, 0, true)  \
+	X(u8_overflow,      0xff, 2, false) \
+	X(u8_overflow_comb, 0xff, 8, true)  \
+	X(u7_overflow,      0x7f, 2, false) \
+	X(u7_overflow_comb, 0x7f, 7, true)
+
+// Slope counts of ss1/ss1c, ss1.6, ss2, ss2.3 and ss3, respectively.
+#define ENCODE_KERNEL_NUM_DELTAS(X, ...) \
+	X(__VA_ARGS__, 2) \
+	X(__VA_ARGS__, 3) \
+	X(__VA_ARGS__, 4) \
+	X(__VA_ARGS__, 5) \
+	X(__VA_ARGS__, 8)
+
+// Kernels with at least this many deltas evaluate all of the codewords at once with
+// vector operations.
+#define ENCODE_KERNEL_SIMD_MIN_DELTAS 8
+
+// The kernels are compiled for AVX2 and SSE4.1 too, and the best version for the
+// running CPU is picked at load time.
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define ENCODE_KERNEL_CLONES_ __attribute__((target_clones("avx2", "sse4.1", "default")))
+#else
+#define ENCODE_KERNEL_CLONES_
+#endif
+
+typedef int32_t v8i32_ __attribute__((vector_size(32)));
+typedef int64_t v8i64_ __attribute__((vector_size(64)));
+typedef uint64_t v8u64_ __attribute__((vector_size(64)));
+
+/* ------------------------------------------------------------------------- */
+// Same as the calc_sigma_*_ functions from the sigma tracker implementations, minus the
+// comb filter, which is applied by the caller.
+static inline uint64_t
+calc_kernel_error_ (sample_t predicted, sample_t expected, const sample_t mask, const uint8_t overflow_shift)
+{
+	sample_t diff;
+	
+	if (mask)
+	{
+		diff = (predicted & mask) - (expected & mask);
+	}
+	else
+	{
+		diff = predicted - expected;
+	}
+	if (diff < 0)
+	{
+		diff = -diff;
+	}
+	if (mask && predicted != (predicted & mask))
+	{
+		diff <<= overflow_shift;
+	}
+	
+	return (uint64_t)diff * diff;
+}
+
+// Lane-wise minimum of the key vector and a permutation of it.
+#define MIN_KEY_SHUFFLED_(key, ...) \
+{ \
+	v8i32_ shuffled = __builtin_shuffle((key), (v8i32_){__VA_ARGS__}); \
+	v8i32_ is_less = ((key) < shuffled); \
+	(key) = ((key) & is_less) | (shuffled & ~is_less); \
+}
+
+/* ------------------------------------------------------------------------- */
+// Vectorized version of calc_kernel_error_(), including the comb filter averaging of the
+// predicted samples, for the given slopes added to the previous decoded samples.
+// Stores the square root of the error of each lane in diff.
+// Samples and slopes must fit in 28 bits, which is true for 8 and 16-bit audio.
+static inline __attribute__((always_inline)) void
+calc_kernel_diff_simd_ (
+	v8i32_ *diff, const v8i32_ *slopes, const v8i32_ *previous, int32_t expected, const int32_t mask, const uint8_t overflow_shift, const bool comb)
+{
+	v8i32_ predicted = *previous + *slopes;
+	v8i32_ sign;
+	
+	if (comb)
+	{
+		predicted += *previous;
+		predicted /= 2;
+	}
+	if (mask)
+	{
+		v8i32_ masked = predicted & mask;
+		v8i32_ overflow = (masked != predicted);
+		*diff = masked - (expected & mask);
+		sign = *diff >> 31;
+		*diff = (*diff ^ sign) - sign;
+		*diff <<= overflow & overflow_shift;
+	}
+	else
+	{
+		*diff = predicted - expected;
+		sign = *diff >> 31;
+		*diff = (*diff ^ sign) - sign;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+// Vectorized version of the codeword loop, evaluating up to 8 codewords, one per lane.
+// Since the error is the square of a non-negative value, the argmin is taken over that
+// value instead. The lane index is packed into its low bits, so that a single horizontal
+// minimum yields both the smallest error and the first codeword that reaches it, just
+// like the scalar loop.
+static inline __attribute__((always_inline)) codeword_t
+find_best_delta_simd_ (
+	const v8i32_ *slopes, int32_t sample_state, int32_t expected, uint64_t *best_error, const int32_t mask, const uint8_t overflow_shift, const bool comb)
+{
+	v8i32_ previous = (v8i32_){0} + sample_state;
+	v8i32_ key;
+	
+	calc_kernel_diff_simd_(&key, slopes, &previous, expected, mask, overflow_shift, comb);
+	
+	key = (key << 3) | (v8i32_){0, 1, 2, 3, 4, 5, 6, 7};
+	MIN_KEY_SHUFFLED_(key, 4, 5, 6, 7, 0, 1, 2, 3);
+	MIN_KEY_SHUFFLED_(key, 2, 3, 0, 1, 6, 7, 4, 5);
+	MIN_KEY_SHUFFLED_(key, 1, 0, 3, 2, 5, 4, 7, 6);
+	
+	*best_error = (uint64_t)(key[0] >> 3) * (key[0] >> 3);
+	return key[0] & 0x07;
+}
+
+/* ------------------------------------------------------------------------- */
+static inline __attribute__((always_inline)) uint64_t
+encode_kernel_ (
+	ssdpcm_block *block, sample_t *in, uint64_t error_bound, const uint8_t num_deltas, const sample_t mask, const uint8_t overflow_shift, const bool comb)
+{
+	sample_t slopes[16];
+	sample_t sample_state = block->initial_sample;
+	uint64_t acc_error = 0;
+	v8i32_ slopes_simd;
+	size_t i;
+	codeword_t c;
+	
+	debug_assert(block->num_deltas == num_deltas);
+	debug_assert(num_deltas <= 8);
+	memcpy(slopes, block->slopes, num_deltas * sizeof(sample_t));
+	
+	// Unused lanes repeat the first slope, so they can never win over the first codeword
+	for (c = 0; c < 8; c++)
+	{
+		slopes_simd[c] = slopes[c < num_deltas ? c : 0];
+	}
+	
+	for (i = 0; i < block->length; i++)
+	{
+		sample_t expected = in[i];
+		uint64_t best_error = UINT64_MAX;
+		codeword_t best = 0;
+		
+		if (comb && i > 0)
+		{
+			expected *= 2;
+			expected += in[i - 1];
+			expected /= 3;
+		}
+		if (num_deltas >= ENCODE_KERNEL_SIMD_MIN_DELTAS && (!comb || i > 0))
+		{
+			best = find_best_delta_simd_(&slopes_simd, sample_state, expected, &best_error, mask, overflow_shift, comb);
+		}
+		else
+		{
+			for (c = 0; c < num_deltas; c++)
+			{
+				sample_t predicted = sample_state + slopes[c];
+				uint64_t error;
+				if (comb && i > 0)
+				{
+					predicted += sample_state;
+					predicted /= 2;
+				}
+				error = calc_kernel_error_(predicted, expected, mask, overflow_shift);
+				if (error < best_error)
+				{
+					best_error = error;
+					best = c;
+				}
+			}
+		}
+		
+		block->deltas[i] = best;
+		sample_state += slopes[best];
+		acc_error += best_error;
+		if (acc_error >= error_bound)
+		{
+			break;
+		}
+	}
+	
+	return acc_error;
+}
+
+#define DEFINE_ENCODE_KERNEL_(tracker, mask, overflow_shift, comb, n) \
+ENCODE_KERNEL_CLONES_ static uint64_t \
+ssdpcm_block_encode_##tracker##_##n (ssdpcm_block *block, sample_t *in, sigma_tracker *sigma, uint64_t error_bound) \
+{ \
+	(void) sigma; \
+	return encode_kernel_(block, in, error_bound, n, mask, overflow_shift, comb); \
+}
+
+#define DEFINE_ENCODE_KERNELS_(tracker, mask, overflow_shift, comb) \
+	ENCODE_KERNEL_NUM_DELTAS(DEFINE_ENCODE_KERNEL_, tracker, mask, overflow_shift, comb)
+
+ENCODE_KERNEL_TRACKERS(DEFINE_ENCODE_KERNELS_)
+
+/* ------------------------------------------------------------------------- */
+// Batched version of encode_kernel_(), running the encoder for up to 8 candidate slope
+// sets in lock-step, one per lane. Only the error metrics are computed; the block's
+// slopes and codewords are left untouched.
+// Encoding is abandoned once every candidate's accumulated error has reached the bound,
+// which is checked every few samples, so that partial sums may go past it a little.
+static inline __attribute__((always_inline)) void
+encode_batch_kernel_ (
+	ssdpcm_block *block, sample_t *in, const sample_t *slopes, size_t num_candidates, uint64_t error_bound, uint64_t *errors, const uint8_t num_deltas, const sample_t mask, const uint8_t overflow_shift, const bool comb)
+{
+	v8i32_ slopes_simd[8];
+	v8i32_ sample_state = (v8i32_){0} + (int32_t)block->initial_sample;
+	v8u64_ acc_error = {0};
+	size_t i, j;
+	codeword_t c;
+	
+	debug_assert(block->num_deltas == num_deltas);
+	debug_assert(num_candidates > 0 && num_candidates <= SSDPCM_ENCODE_BATCH_SIZE);
+	
+	// Unused lanes repeat the first candidate
+	for (c = 0; c < num_deltas; c++)
+	{
+		for (j = 0; j < 8; j++)
+		{
+			slopes_simd[c][j] = slopes[(j < num_candidates ? j : 0) * num_deltas + c];
+		}
+	}
+	
+	for (i = 0; i < block->length; i++)
+	{
+		sample_t expected = in[i];
+		v8i32_ best_diff, best_slope, diff;
+		v8u64_ best_diff_wide;
+		
+		if (comb && i > 0)
+		{
+			expected *= 2;
+			expected += in[i - 1];
+			expected /= 3;
+		}
+		
+		calc_kernel_diff_simd_(&best_diff, &slopes_simd[0], &sample_state, expected, mask, overflow_shift, comb && i > 0);
+		best_slope = slopes_simd[0];
+		for (c = 1; c < num_deltas; c++)
+		{
+			v8i32_ is_less;
+			calc_kernel_diff_simd_(&diff, &slopes_simd[c], &sample_state, expected, mask, overflow_shift, comb && i > 0);
+			is_less = (diff < best_diff);
+			best_diff = (diff & is_less) | (best_diff & ~is_less);
+			best_slope = (slopes_simd[c] & is_less) | (best_slope & ~is_less);
+		}
+		
+		sample_state += best_slope;
+		best_diff_wide = __builtin_convertvector(best_diff, v8u64_);
+		acc_error += best_diff_wide * best_diff_wide;
+		if ((i & 0x07) == 0x07)
+		{
+			v8i64_ below_bound = (acc_error < error_bound);
+			bool any_below = false;
+			for (j = 0; j < 8; j++)
+			{
+				any_below |= below_bound[j] != 0;
+			}
+			if (!any_below)
+			{
+				break;
+			}
+		}
+	}
+	
+	for (j = 0; j < num_candidates; j++)
+	{
+		errors[j] = acc_error[j];
+	}
+}
+
+#define DEFINE_ENCODE_BATCH_KERNEL_(tracker, mask, overflow_shift, comb, n) \
+ENCODE_KERNEL_CLONES_ static void \
+ssdpcm_block_encode_batch_##tracker##_##n ( \
+	ssdpcm_block *block, sample_t *in, sigma_tracker *sigma, const sample_t *slopes, size_t num_candidates, uint64_t error_bound, uint64_t *errors) \
+{ \
+	(void) sigma; \
+	encode_batch_kernel_(block, in, slopes, num_candidates, error_bound, errors, n, mask, overflow_shift, comb); \
+}
+
+#define DEFINE_ENCODE_BATCH_KERNELS_(tracker, mask, overflow_shift, comb) \
+	ENCODE_KERNEL_NUM_DELTAS(DEFINE_ENCODE_BATCH_KERNEL_, tracker, mask, overflow_shift, comb)
+
+ENCODE_KERNEL_TRACKERS(DEFINE_ENCODE_BATCH_KERNELS_)
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_block_encode_select: Picks the block encoder to be used for all candidates
+// of a block, given the block's error tracker and number of deltas.
+// Falls back to ssdpcm_block_encode_bounded() if there's no specialized encoder
+// for that combination.
+ssdpcm_block_encode_func
+ssdpcm_block_encode_select (sigma_tracker_methods methods, uint8_t num_deltas)
+{
+#define SELECT_ENCODE_KERNEL_(tracker, mask, overflow_shift, comb, n) \
+	if (methods == sigma_##tracker && num_deltas == n) \
+	{ \
+		return &ssdpcm_block_encode_##tracker##_##n; \
+	}
+#define SELECT_ENCODE_KERNELS_(tracker, mask, overflow_shift, comb) \
+	ENCODE_KERNEL_NUM_DELTAS(SELECT_ENCODE_KERNEL_, tracker, mask, overflow_shift, comb)
+	
+	ENCODE_KERNEL_TRACKERS(SELECT_ENCODE_KERNELS_)
+	
+	return &ssdpcm_block_encode_bounded;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_block_encode_batch_select: Picks the batch block encoder to be used for all
+// candidates of a block, given the block's error tracker and number of deltas.
+// Falls back to ssdpcm_block_encode_batch_bounded() if there's no specialized encoder
+// for that combination.
+ssdpcm_block_encode_batch_func
+ssdpcm_block_encode_batch_select (sigma_tracker_methods methods, uint8_t num_deltas)
+{
+#define SELECT_ENCODE_BATCH_KERNEL_(tracker, mask, overflow_shift, comb, n) \
+	if (methods == sigma_##tracker && num_deltas == n) \
+	{ \
+		return &ssdpcm_block_encode_batch_##tracker##_##n; \
+	}
+#define SELECT_ENCODE_BATCH_KERNELS_(tracker, mask, overflow_shift, comb) \
+	ENCODE_KERNEL_NUM_DELTAS(SELECT_ENCODE_BATCH_KERNEL_, tracker, mask, overflow_shift, comb)
+	
+	ENCODE_KERNEL_TRACKERS(SELECT_ENCODE_BATCH_KERNELS_)
+	
+	return &ssdpcm_block_encode_batch_bounded;
+}
@@ -23,17 +23,215 @@
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include "encode_search_funcs.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* ------------------------------------------------------------------------- */
+// Moves the slopes to the next point of the grid walked by a binary search level, which
+// counts up like an odometer, in steps of 1 << chop_bits, with the slopes kept in
+// decreasing order. The walk is over once the first slope is past its range.
+static inline void
+next_grid_point_ (sample_t *slopes, uint8_t half_num_deltas, uint8_t chop_bits, const sample_t *ranges_low, const sample_t *ranges_hi)
+{
+	int i;
+	
+	for (i = half_num_deltas - 1; i >= 0; i--)
+	{
+		slopes[i] += 1 << chop_bits;
+		if (i > 0 && (slopes[i] >= slopes[i - 1] || slopes[i] > ranges_hi[i]))
+		{
+			slopes[i] = ranges_low[i];
+			slopes[i + half_num_deltas] = -ranges_low[i];
+		}
+		else
+		{
+			slopes[i + half_num_deltas] = -slopes[i];
+			break;
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+// Counts the points of the grid walked by a binary search level, starting from the
+// block's current slopes.
+static inline size_t
+count_grid_points_ (
+	const ssdpcm_block *dest, uint8_t chop_bits, const sample_t *ranges_low, const sample_t *ranges_hi, sample_t max_abs_delta)
+{
+	sample_t *slopes;
+	size_t num_points = 0;
+	
+	slopes = calloc(dest->num_deltas, sizeof(sample_t));
+	memcpy(slopes, dest->slopes, dest->num_deltas * sizeof(sample_t));
+	while (slopes[0] <= max_abs_delta && slopes[0] <= ranges_hi[0])
+	{
+		num_points++;
+		next_grid_point_(slopes, dest->num_deltas / 2, chop_bits, ranges_low, ranges_hi);
+	}
+	free(slopes);
+	return num_points;
+}
+
+// Minimum number of grid points for each thread of a binary search level split across
+// threads, so that the threads get enough work to be worth starting.
+#define MIN_GRID_POINTS_PER_THREAD 64
+
+// State of a thread searching a slice of a binary search level's grid, with its own
+// copies of the block, error tracker and memo cache.
+typedef struct
+{
+	ssdpcm_block block;
+	sigma_tracker sigma;
+	memo_cache_ memo;
+	ssdpcm_search_stats stats;
+	sample_t *best_slopes;
+	uint64_t best_metric;
+} grid_slice_;
+
+/* ------------------------------------------------------------------------- */
+// Searches the points of a binary search level's grid from first up to, not including,
+// last, counting from the slice's block's current slopes.
+static inline void
+search_grid_slice_ (
+	grid_slice_ *slice, sample_t *in, ssdpcm_block_encode_batch_func encode_batch, uint8_t chop_bits, const sample_t *ranges_low, const sample_t *ranges_hi, size_t first, size_t last)
+{
+	uint8_t half_num_deltas = slice->block.num_deltas / 2;
+	sample_t *candidates;
+	size_t num_candidates = 0;
+	size_t i;
+	
+	candidates = calloc(SSDPCM_ENCODE_BATCH_SIZE * slice->block.num_deltas, sizeof(sample_t));
+	for (i = 0; i < first; i++)
+	{
+		next_grid_point_(slice->block.slopes, half_num_deltas, chop_bits, ranges_low, ranges_hi);
+	}
+	for (; i < last; i++)
+	{
+		queue_candidate_(&slice->block, in, &slice->sigma, encode_batch, &slice->memo, &slice->stats, candidates, &num_candidates, slice->best_slopes, &slice->best_metric);
+		next_grid_point_(slice->block.slopes, half_num_deltas, chop_bits, ranges_low, ranges_hi);
+	}
+	flush_candidates_(&slice->block, in, &slice->sigma, encode_batch, &slice->memo, candidates, &num_candidates, slice->best_slopes, &slice->best_metric);
+	free(candidates);
+}
+
+/* ------------------------------------------------------------------------- */
+// Binary search level with its grid split into one contiguous slice per thread. Each
+// slice keeps its first best candidate, so taking the first slice with the lowest
+// metric gives the same result as walking the whole grid in order. The threads' memo
+// caches are merged back once they're done.
+static inline uint64_t
+do_binary_search_internal_parallel_ (
+	ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, ssdpcm_block_encode_batch_func encode_batch, memo_cache_ *memo, ssdpcm_search_stats *stats, uint8_t num_deltas, uint8_t chop_bits, sample_t *ranges_low, sample_t *ranges_hi, size_t num_points, int num_threads)
+{
+	grid_slice_ *slices;
+	uint8_t half_num_deltas = num_deltas / 2;
+	uint64_t best_metric;
+	int t, best;
+	
+	slices = calloc(num_threads, sizeof(grid_slice_));
+	
+	#pragma omp parallel for num_threads(num_threads) schedule(static, 1)
+	for (t = 0; t < num_threads; t++)
+	{
+		grid_slice_ *slice = &slices[t];
+		int i;
+		
+		slice->block = *dest;
+		slice->block.slopes = calloc(num_deltas, sizeof(sample_t));
+		slice->block.deltas = calloc(dest->length, sizeof(codeword_t));
+		memcpy(slice->block.slopes, dest->slopes, num_deltas * sizeof(sample_t));
+		slice->sigma.methods = sigma->methods;
+		slice->sigma.methods->alloc(&slice->sigma.state);
+		memo_copy_(&slice->memo, memo);
+		slice->best_slopes = calloc(num_deltas, sizeof(sample_t));
+		for (i = 0; i < half_num_deltas; i++)
+		{
+			slice->best_slopes[i] = dest->slopes[i];
+			slice->best_slopes[i + half_num_deltas] = -dest->slopes[i];
+		}
+		slice->best_metric = UINT64_MAX;
+		
+		search_grid_slice_(slice, in, encode_batch, chop_bits, ranges_low, ranges_hi, num_points * t / num_threads, num_points * (t + 1) / num_threads);
+		
+		slice->sigma.methods->free(&slice->sigma.state);
+		free(slice->block.slopes);
+		free(slice->block.deltas);
+	}
+	
+	best = 0;
+	for (t = 0; t < num_threads; t++)
+	{
+		if (slices[t].best_metric < slices[best].best_metric)
+		{
+			best = t;
+		}
+		stats->candidates += slices[t].stats.candidates;
+		stats->memo_hits += slices[t].stats.memo_hits;
+		if (memo->size_bits)
+		{
+			memo_merge_(memo, &slices[t].memo);
+		}
+	}
+	
+	best_metric = slices[best].best_metric;
+	memcpy(dest->slopes, slices[best].best_slopes, num_deltas * sizeof(sample_t));
+	ssdpcm_search_report_metric(best_metric);
+	for (t = 0; t < num_threads; t++)
+	{
+		memo_free_(&slices[t].memo);
+		free(slices[t].best_slopes);
+	}
+	free(slices);
+	return best_metric;
+}
+
+/* ------------------------------------------------------------------------- */
+// Number of threads a binary search level's grid can be split across. Only searches
+// that run on their own, and that have no budget or target error, which depend on the
+// order the candidates are encoded in, are split.
+static inline int
+grid_search_threads_ (void)
+{
+#ifdef _OPENMP
+	if (!omp_in_parallel() && !ssdpcm_search_is_limited())
+	{
+		return omp_get_max_threads();
+	}
+#endif
+	return 1;
+}
+
+/* ------------------------------------------------------------------------- */
 static inline uint64_t
 do_binary_search_internal_ (
-	ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, uint8_t num_deltas, uint8_t chop_bits, sample_t *ranges_low, sample_t *ranges_hi, sample_t max_abs_delta)
+	ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, ssdpcm_block_encode_batch_func encode_batch, memo_cache_ *memo, ssdpcm_search_stats *stats, uint8_t num_deltas, uint8_t chop_bits, sample_t *ranges_low, sample_t *ranges_hi, sample_t max_abs_delta)
 {
 	int i;
 	sample_t *best_slopes;
+	sample_t *candidates;
+	size_t num_candidates = 0;
 	uint64_t best_metric = UINT64_MAX;
 	uint8_t half_num_deltas = num_deltas / 2;
+	int num_threads = grid_search_threads_();
+	
+	if (num_threads > 1)
+	{
+		size_t num_points = count_grid_points_(dest, chop_bits, ranges_low, ranges_hi, max_abs_delta);
+		if (num_points / MIN_GRID_POINTS_PER_THREAD < (size_t) num_threads)
+		{
+			num_threads = num_points / MIN_GRID_POINTS_PER_THREAD;
+		}
+		if (num_threads > 1)
+		{
+			return do_binary_search_internal_parallel_(dest, in, sigma, encode_batch, memo, stats, num_deltas, chop_bits, ranges_low, ranges_hi, num_points, num_threads);
+		}
+	}
 	
 	best_slopes = calloc(num_deltas, sizeof(sample_t));
+	candidates = calloc(SSDPCM_ENCODE_BATCH_SIZE * num_deltas, sizeof(sample_t));
 	
 	for (i = 0; i < half_num_deltas; i++)
 	{
@@ -41,10 +239,10 @@ do_binary_search_internal_ (
 		best_slopes[i + half_num_deltas] = -dest->slopes[i];
 	}
 	
-	while (dest->slopes[0] <= max_abs_delta && dest->slopes[0] <= ranges_hi[0])
+	while (dest->slopes[0] <= max_abs_delta && dest->slopes[0] <= ranges_hi[0] && !ssdpcm_search_should_stop())
 	{
-		uint64_t sigma_metric = ssdpcm_block_encode(dest, in, sigma);
-		
+		queue_candidate_(dest, in, sigma, encode_batch, memo, stats, candidates, &num_candidates, best_slopes, &best_metric);
+
 #if 0
 		for (i = 0; i < num_deltas; i++)
 		{
@@ -53,48 +251,141 @@ do_binary_search_internal_ (
 		fprintf(stderr, "\n");
 #endif
 		
-		if (sigma_metric < best_metric)
+		next_grid_point_(dest->slopes, half_num_deltas, chop_bits, ranges_low, ranges_hi);
+	}
+	
+	flush_candidates_(dest, in, sigma, encode_batch, memo, candidates, &num_candidates, best_slopes, &best_metric);
+	memcpy(dest->slopes, best_slopes, num_deltas * sizeof(sample_t));
+	free(candidates);
+	free(best_slopes);
+	return best_metric;
+}
+
+/* ------------------------------------------------------------------------- */
+// Modes with a single positive slope try every slope when they fit in this many
+// batches, which covers all of the slopes of 8-bit audio.
+#define SINGLE_SLOPE_EXHAUSTIVE_BATCHES 32
+
+// Batches of evenly spread slopes in the coarse pass over wider ranges.
+#define SINGLE_SLOPE_COARSE_BATCHES 8
+
+/* ------------------------------------------------------------------------- */
+// Search for modes with a single positive slope. The error metric isn't unimodal, so
+// narrowing the range down can miss the best slope; when all of the slopes fit in
+// SINGLE_SLOPE_EXHAUSTIVE_BATCHES batches, they are all tried. Otherwise, a coarse pass
+// spreads SINGLE_SLOPE_COARSE_BATCHES batches of slopes over the range, and a section
+// search narrows down the range between the neighbors of the best one.
+static inline void
+do_single_slope_search_ (
+	ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, ssdpcm_block_encode_batch_func encode_batch, ssdpcm_search_stats *stats, sample_t max_abs_delta)
+{
+	const sample_t num_points = SINGLE_SLOPE_COARSE_BATCHES * SSDPCM_ENCODE_BATCH_SIZE;
+	sample_t *best_slopes;
+	sample_t *candidates;
+	uint64_t best_metric = UINT64_MAX;
+	memo_cache_ memo;
+	size_t num_candidates = 0;
+	sample_t step;
+	sample_t best;
+	sample_t i;
+	
+	best_slopes = calloc(dest->num_deltas, sizeof(sample_t));
+	candidates = calloc(SSDPCM_ENCODE_BATCH_SIZE * dest->num_deltas, sizeof(sample_t));
+	memo_alloc_(&memo, 1, max_abs_delta);
+	memcpy(best_slopes, dest->slopes, dest->num_deltas * sizeof(sample_t));
+	
+	if (max_abs_delta < SINGLE_SLOPE_EXHAUSTIVE_BATCHES * SSDPCM_ENCODE_BATCH_SIZE)
+	{
+		search_slope_range_(dest, in, sigma, encode_batch, &memo, stats, candidates, best_slopes, &best_metric, 0, 0, max_abs_delta);
+	}
+	else
+	{
+		for (i = 0; i < num_points && !ssdpcm_search_should_stop(); i++)
 		{
-			best_metric = sigma_metric;
-			memcpy(best_slopes, dest->slopes, half_num_deltas * 2 * sizeof(sample_t));
+			dest->slopes[0] = max_abs_delta * i / (num_points - 1);
+			dest->slopes[1] = -dest->slopes[0];
+			queue_candidate_(dest, in, sigma, encode_batch, &memo, stats, candidates, &num_candidates, best_slopes, &best_metric);
 		}
+		flush_candidates_(dest, in, sigma, encode_batch, &memo, candidates, &num_candidates, best_slopes, &best_metric);
 		
-		for (i = half_num_deltas - 1; i >= 0; i--)
+		step = max_abs_delta / (num_points - 1) + 1;
+		best = best_slopes[0];
+		memcpy(dest->slopes, best_slopes, dest->num_deltas * sizeof(sample_t));
+		do_section_search_(dest, in, sigma, encode_batch, &memo, stats, candidates, best_slopes, &best_metric, 0, best - step < 0 ? 0 : best - step, best + step > max_abs_delta ? max_abs_delta : best + step);
+	}
+	memcpy(dest->slopes, best_slopes, dest->num_deltas * sizeof(sample_t));
+	
+	free(best_slopes);
+	free(candidates);
+	memo_free_(&memo);
+}
+
+/* ------------------------------------------------------------------------- */
+// Refinement levels of the binary search, from chop_bits down to 0, each searching a
+// window around the block's current slopes with half the step of the previous level.
+// best_metric is the error metric of the block's current slopes, if known.
+// Returns the error metric of the best slopes, which are left in the block.
+static inline uint64_t
+do_binary_search_levels_ (
+	ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, ssdpcm_block_encode_batch_func encode_batch, memo_cache_ *memo, ssdpcm_search_stats *stats, uint8_t num_deltas, int8_t chop_bits, sample_t *ranges_low, sample_t *ranges_high, sample_t max_abs_delta, uint64_t best_metric)
+{
+	uint8_t half_num_deltas = num_deltas / 2;
+	uint64_t level_metric;
+	sample_t *best_slopes;
+	
+	best_slopes = calloc(num_deltas, sizeof(sample_t));
+	memcpy(best_slopes, dest->slopes, num_deltas * sizeof(sample_t));
+	
+	for (; chop_bits >= 0 && !ssdpcm_search_should_stop(); chop_bits--)
+	{
+		int i;
+		for (i = 0; i < half_num_deltas; i++)
 		{
-			dest->slopes[i] += 1 << chop_bits;
-			if (i > 0 && (dest->slopes[i] >= dest->slopes[i - 1] || dest->slopes[i] > ranges_hi[i]))
-			{
-				dest->slopes[i] = ranges_low[i];
-				dest->slopes[i + half_num_deltas] = -ranges_low[i];
-			}
-			else
+			dest->slopes[i] -= (1 << chop_bits);
+			if (dest->slopes[i] < 0)
 			{
-				dest->slopes[i + half_num_deltas] = -dest->slopes[i];
-				break;
+				dest->slopes[i] += (2 << chop_bits);
 			}
+			dest->slopes[i + half_num_deltas] = -dest->slopes[i];
+			ranges_low[i] = (dest->slopes[i] - (1 << chop_bits)) < 0 ? 0 : (dest->slopes[i] - (1 << chop_bits));
+			ranges_high[i] = dest->slopes[i] + (1 << chop_bits);
+		}
+		
+		level_metric = do_binary_search_internal_(dest, in, sigma, encode_batch, memo, stats, num_deltas, chop_bits, ranges_low, ranges_high, max_abs_delta);
+		
+		// A level cut short by the budget may not have reached the previous level's best slopes yet
+		if (level_metric > best_metric && ssdpcm_search_should_stop())
+		{
+			memcpy(dest->slopes, best_slopes, num_deltas * sizeof(sample_t));
+			break;
 		}
+		best_metric = level_metric;
+		memcpy(best_slopes, dest->slopes, num_deltas * sizeof(sample_t));
 	}
 	
-	memcpy(dest->slopes, best_slopes, num_deltas * sizeof(sample_t));
 	free(best_slopes);
 	return best_metric;
 }
 
 #define CHOP_PARAM 4
 
-static inline void
+// Returns the error metric of the best slopes, which are left in the block.
+static inline uint64_t
 do_binary_search_ (
-	ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, uint8_t num_deltas, sample_t max_abs_delta)
+	ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, ssdpcm_block_encode_batch_func encode_batch, ssdpcm_search_stats *stats, uint8_t num_deltas, sample_t max_abs_delta, uint8_t grid_bits)
 {
 	int i;
+	uint64_t best_metric;
+	memo_cache_ memo;
 	sample_t *best_slopes;
 	uint8_t half_num_deltas = num_deltas / 2;
-	int8_t chop_bits = round(log2(max_abs_delta)) - CHOP_PARAM;
+	int8_t chop_bits = round(log2(max_abs_delta)) - grid_bits;
 	sample_t *ranges_low, *ranges_high;
 	
 	best_slopes = calloc(num_deltas, sizeof(sample_t));
 	ranges_low = calloc(half_num_deltas, sizeof(sample_t));
 	ranges_high = calloc(half_num_deltas, sizeof(sample_t));
+	memo_alloc_(&memo, half_num_deltas, max_abs_delta);
 	
 	if (chop_bits < 0)
 	{
@@ -111,60 +402,245 @@ do_binary_search_ (
 		ranges_high[i] = INT32_MAX;
 	}
 	
-	(void) do_binary_search_internal_(dest, in, sigma, num_deltas, chop_bits, ranges_low, ranges_high, max_abs_delta);
-
-	chop_bits--;
-	
-	for (; chop_bits >= 0; chop_bits--)
-	{
-		int i;
-		for (i = 0; i < half_num_deltas; i++)
-		{
-			dest->slopes[i] -= (1 << chop_bits);
-			if (dest->slopes[i] < 0)
-			{
-				dest->slopes[i] += (2 << chop_bits);
-			}
-			dest->slopes[i + half_num_deltas] = -dest->slopes[i];
-			ranges_low[i] = (dest->slopes[i] - (1 << chop_bits)) < 0 ? 0 : (dest->slopes[i] - (1 << chop_bits));
-			ranges_high[i] = dest->slopes[i] + (1 << chop_bits);
-		}
-		
-		(void) do_binary_search_internal_(dest, in, sigma, num_deltas, chop_bits, ranges_low, ranges_high, max_abs_delta);
-	}
+	best_metric = do_binary_search_internal_(dest, in, sigma, encode_batch, &memo, stats, num_deltas, chop_bits, ranges_low, ranges_high, max_abs_delta);
+	best_metric = do_binary_search_levels_(dest, in, sigma, encode_batch, &memo, stats, num_deltas, chop_bits - 1, ranges_low, ranges_high, max_abs_delta, best_metric);
 	
 	//fprintf(stderr, " max_abs_delta=%ld ", max_abs_delta);
 	//fprintf(stderr, "slope0=%ld\n", dest->slopes[0]);
 	free(best_slopes);
 	free(ranges_low);
 	free(ranges_high);
+	memo_free_(&memo);
+	return best_metric;
 }
 
-uint64_t
-ssdpcm_encode_binary_search (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma)
+/* ------------------------------------------------------------------------- */
+// Fast path for digital silence and other nearly constant blocks: if the smallest
+// possible slopes (..., 2, 1, 0) cover every difference between successive samples,
+// the encoder can follow the input exactly, and as no slopes can do better than no
+// error at all, there's nothing to search for. The slopes are checked by encoding
+// the block with them, as some error trackers don't see the input as it is.
+// Returns true if the block was encoded that way; otherwise, the block's slopes are left
+// as they were, since the warm-started search starts from them.
+static inline bool
+encode_flat_block_ (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, sample_t max_abs_delta)
 {
-	sample_t max_abs_delta = 0;
-	sample_t delta;
-	size_t i;
+	int i;
+	uint8_t half_num_deltas = dest->num_deltas / 2;
+	// With an odd number of slopes, the last one is always 0
+	sample_t top_slope = half_num_deltas - 1 + (dest->num_deltas & 1);
+	sample_t previous_slopes[16];
+	ssdpcm_block_encode_func encode;
+	
+	if (max_abs_delta > top_slope)
+	{
+		return false;
+	}
+	
+	debug_assert(dest->num_deltas <= 16);
+	memcpy(previous_slopes, dest->slopes, dest->num_deltas * sizeof(sample_t));
+	for (i = 0; i < half_num_deltas; i++)
+	{
+		dest->slopes[i] = top_slope - i;
+		dest->slopes[i + half_num_deltas] = -dest->slopes[i];
+	}
+	if (dest->num_deltas & 1)
+	{
+		dest->slopes[dest->num_deltas - 1] = 0;
+	}
+	
+	encode = ssdpcm_block_encode_select(sigma->methods, dest->num_deltas);
+	ssdpcm_search_block_stats.candidates++;
+	if (encode(dest, in, sigma, 1) != 0)
+	{
+		memcpy(dest->slopes, previous_slopes, dest->num_deltas * sizeof(sample_t));
+		return false;
+	}
+	ssdpcm_search_block_stats.flat_blocks = 1;
+	return true;
+}
 
+/* ------------------------------------------------------------------------- */
+// ssdpcm_encode_flat_block: Encodes an SSDPCM block (given preinitialized fields)
+// without searching for its slopes if it's digital silence or close enough to it
+// for the smallest possible slopes to encode it losslessly.
+// Returns true if the block was encoded, with an error metric of 0.
+bool
+ssdpcm_encode_flat_block (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma)
+{
 	debug_assert(dest != NULL);
 	debug_assert(in != NULL);
 	debug_assert(sigma != NULL);
 	
-	// Find biggest difference between two successive samples
-	for (i = 1; i < dest->length; i++)
+	return encode_flat_block_(dest, in, sigma, find_max_abs_delta_(dest, in));
+}
+
+/* ------------------------------------------------------------------------- */
+// Number of candidates on the first level of the binary search with 2^grid_bits steps
+// per slope: the ways of picking the positive slopes out of the points of the grid that
+// are within max_abs_delta.
+static inline uint64_t
+count_first_level_candidates_ (uint8_t half_num_deltas, sample_t max_abs_delta, uint8_t grid_bits)
+{
+	int8_t chop_bits = max_abs_delta > 0 ? round(log2(max_abs_delta)) - grid_bits : 0;
+	uint64_t points = (max_abs_delta >> (chop_bits < 0 ? 0 : chop_bits)) + 1;
+	uint64_t count = 1;
+	int i;
+	
+	for (i = 0; i < half_num_deltas && (uint64_t)i < points; i++)
 	{
-		delta = in[i] - in[i - 1];
-		if (delta < 0)
+		count = count * (points - i) / (i + 1);
+	}
+	return i < half_num_deltas ? 0 : count;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_encode_binary_search_grid: Same as ssdpcm_encode_binary_search(), but with
+// 2^grid_bits steps per slope on the first, coarsest level of the search instead of
+// 2^CHOP_PARAM. A coarser grid is much cheaper, especially with many slopes, and is
+// meant to be followed by ssdpcm_encode_refine().
+// Modes with a single positive slope use a dedicated search, which ignores grid_bits.
+// Flat blocks aren't checked for here, as ssdpcm_search_encode() already skips them.
+uint64_t
+ssdpcm_encode_binary_search_grid (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, uint8_t grid_bits)
+{
+	sample_t max_abs_delta;
+	ssdpcm_block_encode_func encode;
+	ssdpcm_block_encode_batch_func encode_batch;
+	uint64_t max_candidates;
+	
+	debug_assert(dest != NULL);
+	debug_assert(in != NULL);
+	debug_assert(sigma != NULL);
+	
+	max_abs_delta = find_max_abs_delta_(dest, in);
+	
+	// With a limit on the candidates, make the first level coarse enough to leave half of
+	// them to the refinement levels, instead of running out halfway through the first one
+	max_candidates = ssdpcm_search_candidate_budget();
+	while (max_candidates && grid_bits > 1 && count_first_level_candidates_(dest->num_deltas / 2, max_abs_delta, grid_bits) > max_candidates / 2)
+	{
+		grid_bits--;
+	}
+	
+	encode = ssdpcm_block_encode_select(sigma->methods, dest->num_deltas);
+	encode_batch = ssdpcm_block_encode_batch_select(sigma->methods, dest->num_deltas);
+	if (dest->num_deltas / 2 == 1)
+	{
+		do_single_slope_search_(dest, in, sigma, encode_batch, &ssdpcm_search_block_stats, max_abs_delta);
+	}
+	else
+	{
+		do_binary_search_(dest, in, sigma, encode_batch, &ssdpcm_search_block_stats, dest->num_deltas, max_abs_delta, grid_bits);
+	}
+	
+	return encode(dest, in, sigma, UINT64_MAX);
+}
+
+/* ------------------------------------------------------------------------- */
+uint64_t
+ssdpcm_encode_binary_search (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma)
+{
+	return ssdpcm_encode_binary_search_grid(dest, in, sigma, CHOP_PARAM);
+}
+
+/* ------------------------------------------------------------------------- */
+// Window of the warm-started search: the refinement levels start from steps of
+// 1 << WARM_START_WINDOW_BITS around the previous block's slopes.
+#define WARM_START_WINDOW_BITS 2
+
+// Refinement iterations of the clustering that the warm-started result is checked against.
+#define WARM_START_KMEANS_ITERATIONS 4
+
+/* ------------------------------------------------------------------------- */
+// Checks if the block's current slopes can seed a warm-started search: they must
+// be in decreasing order with no repeats, within the range of the full search.
+static inline bool
+can_warm_start_ (ssdpcm_block *dest, sample_t max_abs_delta)
+{
+	int i;
+	uint8_t half_num_deltas = dest->num_deltas / 2;
+	
+	if (half_num_deltas < 2 || dest->slopes[0] > max_abs_delta || dest->slopes[half_num_deltas - 1] < 0)
+	{
+		return false;
+	}
+	for (i = 1; i < half_num_deltas; i++)
+	{
+		if (dest->slopes[i] >= dest->slopes[i - 1])
 		{
-			delta = -delta;
+			return false;
 		}
-		if (delta > max_abs_delta)
+	}
+	return true;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_encode_binary_search_warm: Same as ssdpcm_encode_binary_search(), but
+// the search starts from the slopes already in the block, normally the previous
+// block's, and only looks at a narrow window around them. If the result is worse
+// than what clustering the block's sample differences gives (see
+// ssdpcm_encode_kmeans()), which only costs a handful of encodes, the slopes didn't
+// carry over well and the full search is done instead. The full search is also done
+// when the slopes in the block can't seed the search, e.g. for the first block,
+// and for modes with a single positive slope, whose search is cheap anyway.
+// Returns the accumulated error metric.
+uint64_t
+ssdpcm_encode_binary_search_warm (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma)
+{
+	sample_t max_abs_delta;
+	ssdpcm_block_encode_func encode;
+	ssdpcm_block_encode_batch_func encode_batch;
+	uint8_t half_num_deltas = dest->num_deltas / 2;
+	sample_t *warm_slopes;
+	sample_t *ranges_low, *ranges_high;
+	uint64_t warm_metric, kmeans_metric;
+	memo_cache_ memo;
+	int i;
+	
+	debug_assert(dest != NULL);
+	debug_assert(in != NULL);
+	debug_assert(sigma != NULL);
+	
+	max_abs_delta = find_max_abs_delta_(dest, in);
+	if (!can_warm_start_(dest, max_abs_delta))
+	{
+		return ssdpcm_encode_binary_search(dest, in, sigma);
+	}
+	
+	encode = ssdpcm_block_encode_select(sigma->methods, dest->num_deltas);
+	encode_batch = ssdpcm_block_encode_batch_select(sigma->methods, dest->num_deltas);
+	warm_slopes = calloc(dest->num_deltas, sizeof(sample_t));
+	ranges_low = calloc(half_num_deltas, sizeof(sample_t));
+	ranges_high = calloc(half_num_deltas, sizeof(sample_t));
+	memo_alloc_(&memo, half_num_deltas, max_abs_delta);
+	
+	for (i = 0; i < half_num_deltas; i++)
+	{
+		dest->slopes[i + half_num_deltas] = -dest->slopes[i];
+	}
+	warm_metric = do_binary_search_levels_(dest, in, sigma, encode_batch, &memo, &ssdpcm_search_block_stats, dest->num_deltas, WARM_START_WINDOW_BITS, ranges_low, ranges_high, max_abs_delta, UINT64_MAX);
+	memcpy(warm_slopes, dest->slopes, dest->num_deltas * sizeof(sample_t));
+	
+	kmeans_metric = ssdpcm_encode_kmeans(dest, in, sigma, WARM_START_KMEANS_ITERATIONS);
+	if (warm_metric <= kmeans_metric)
+	{
+		memcpy(dest->slopes, warm_slopes, dest->num_deltas * sizeof(sample_t));
+	}
+	else if (!ssdpcm_search_should_stop())
+	{
+		// Keep the clustered slopes in case the budget runs out before the full search gets as far
+		memcpy(warm_slopes, dest->slopes, dest->num_deltas * sizeof(sample_t));
+		if (do_binary_search_(dest, in, sigma, encode_batch, &ssdpcm_search_block_stats, dest->num_deltas, max_abs_delta, CHOP_PARAM) > kmeans_metric && ssdpcm_search_should_stop())
 		{
-			max_abs_delta = delta;
+			memcpy(dest->slopes, warm_slopes, dest->num_deltas * sizeof(sample_t));
 		}
 	}
 	
-	do_binary_search_(dest, in, sigma, dest->num_deltas, max_abs_delta);
-	return ssdpcm_block_encode(dest, in, sigma);
+	free(warm_slopes);
+	free(ranges_low);
+	free(ranges_high);
+	memo_free_(&memo);
+	
+	return encode(dest, in, sigma, UINT64_MAX);
 }
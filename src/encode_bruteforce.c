@@ -23,16 +23,47 @@
 #include <string.h>
 #include <stdio.h>
 
+/* ------------------------------------------------------------------------- */
+// Encodes the pending candidates of the search in one batch, and keeps track of the
+// best one. Candidates are compared in the order they were queued in, so the result is
+// the same as encoding them one at a time.
+static inline void
+flush_candidates_ (
+	ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, ssdpcm_block_encode_batch_func encode_batch, sample_t *candidates, size_t *num_candidates, sample_t *best_slopes, uint64_t *best_metric)
+{
+	uint64_t errors[SSDPCM_ENCODE_BATCH_SIZE];
+	size_t i;
+	
+	if (*num_candidates == 0)
+	{
+		return;
+	}
+	encode_batch(dest, in, sigma, candidates, *num_candidates, *best_metric, errors);
+	for (i = 0; i < *num_candidates; i++)
+	{
+		if (errors[i] < *best_metric)
+		{
+			*best_metric = errors[i];
+			memcpy(best_slopes, &candidates[i * dest->num_deltas], dest->num_deltas * sizeof(sample_t));
+		}
+	}
+	*num_candidates = 0;
+	ssdpcm_search_report_metric(*best_metric);
+}
+
 static inline void
 do_bruteforce_search_ (
-	ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, uint8_t num_deltas, sample_t max_abs_delta)
+	ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, ssdpcm_block_encode_batch_func encode_batch, uint8_t num_deltas, sample_t max_abs_delta)
 {
 	int i;
 	sample_t *best_slopes;
+	sample_t *candidates;
+	size_t num_candidates = 0;
 	uint64_t best_metric = UINT64_MAX;
 	uint8_t half_num_deltas = num_deltas / 2;
 	
 	best_slopes = calloc(num_deltas, sizeof(sample_t));
+	candidates = calloc(SSDPCM_ENCODE_BATCH_SIZE * num_deltas, sizeof(sample_t));
 	
 	for (i = 0; i < half_num_deltas; i++)
 	{
@@ -42,15 +73,15 @@ do_bruteforce_search_ (
 		best_slopes[i + half_num_deltas] = -dest->slopes[i];
 	}
 	
-	while (dest->slopes[0] <= max_abs_delta)
+	while (dest->slopes[0] <= max_abs_delta && !ssdpcm_search_should_stop())
 	{
-		uint64_t sigma_metric = ssdpcm_block_encode(dest, in, sigma);
-		if (sigma_metric < best_metric)
+		memcpy(&candidates[num_candidates * num_deltas], dest->slopes, num_deltas * sizeof(sample_t));
+		num_candidates++;
+		ssdpcm_search_block_stats.candidates++;
+		if (num_candidates == SSDPCM_ENCODE_BATCH_SIZE)
 		{
-			best_metric = sigma_metric;
-			memcpy(best_slopes, dest->slopes, half_num_deltas * 2 * sizeof(sample_t));
+			flush_candidates_(dest, in, sigma, encode_batch, candidates, &num_candidates, best_slopes, &best_metric);
 		}
-		
 		for (i = half_num_deltas - 1; i >= 0; i--)
 		{
 			dest->slopes[i]++;
@@ -67,7 +98,9 @@ do_bruteforce_search_ (
 		}
 	}
 	
+	flush_candidates_(dest, in, sigma, encode_batch, candidates, &num_candidates, best_slopes, &best_metric);
 	memcpy(dest->slopes, best_slopes, num_deltas * sizeof(sample_t));
+	free(candidates);
 	
 	//fprintf(stderr, " max_abs_delta=%ld ", max_abs_delta);
 	//fprintf(stderr, "slope0=%ld\n", dest->slopes[0]);
@@ -80,6 +113,8 @@ ssdpcm_encode_bruteforce (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma
 	sample_t max_abs_delta = 0;
 	sample_t delta;
 	size_t i;
+	ssdpcm_block_encode_func encode;
+	ssdpcm_block_encode_batch_func encode_batch;
 
 	// One'd have to be insane to expect a brute force algorithm to iterate through more than a couple different deltas in admissible time.
 	assert(dest->num_deltas <= 8 || !"refusing to search through this many deltas");
@@ -101,6 +136,8 @@ ssdpcm_encode_bruteforce (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma
 		}
 	}
 	
-	do_bruteforce_search_(dest, in, sigma, dest->num_deltas, max_abs_delta);
-	return ssdpcm_block_encode(dest, in, sigma);
+	encode = ssdpcm_block_encode_select(sigma->methods, dest->num_deltas);
+	encode_batch = ssdpcm_block_encode_batch_select(sigma->methods, dest->num_deltas);
+	do_bruteforce_search_(dest, in, sigma, encode_batch, dest->num_deltas, max_abs_delta);
+	return encode(dest, in, sigma, UINT64_MAX);
 }
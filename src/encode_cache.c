@@ -0,0 +1,228 @@
+/*
+ * ssdpcm: implementation of the SSDPCM audio codec designed by Algorithm.
+ * Copyright (C) 2022-2025 Kagamiin~
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <types.h>
+#include <encode.h>
+#include <errors.h>
+#include <string.h>
+#include <stdlib.h>
+
+// A block that was already encoded, with everything its encoding depends on: the
+// input samples, the initial sample, the error tracker and the shape of the block.
+typedef struct cache_entry_s
+{
+	struct cache_entry_s *next;
+	uint64_t hash;
+	sigma_tracker_methods methods;
+	sample_t initial_sample;
+	uint8_t num_deltas;
+	size_t length;
+	uint64_t metric;
+	sample_t *samples;
+	sample_t *slopes;
+	codeword_t *deltas;
+} cache_entry_;
+
+static cache_entry_ **buckets_ = NULL;
+static size_t bucket_mask_;
+static size_t max_entries_;
+static size_t num_entries_;
+
+/* ------------------------------------------------------------------------- */
+// FNV-1a over everything the encoding of the block depends on, a sample at a time.
+static inline uint64_t
+hash_block_ (const ssdpcm_block *block, const sample_t *in, sigma_tracker_methods methods)
+{
+	uint64_t hash = 0xcbf29ce484222325u;
+	size_t i;
+	
+	hash = (hash ^ (uint64_t)(uintptr_t)methods) * 0x100000001b3u;
+	hash = (hash ^ (uint64_t)block->initial_sample) * 0x100000001b3u;
+	hash = (hash ^ block->num_deltas) * 0x100000001b3u;
+	hash = (hash ^ block->length) * 0x100000001b3u;
+	for (i = 0; i < block->length; i++)
+	{
+		hash = (hash ^ (uint64_t)in[i]) * 0x100000001b3u;
+	}
+	return hash;
+}
+
+static inline bool
+entry_matches_ (const cache_entry_ *entry, uint64_t hash, const ssdpcm_block *block, const sample_t *in, sigma_tracker_methods methods)
+{
+	if (entry->hash != hash || entry->methods != methods || entry->initial_sample != block->initial_sample)
+	{
+		return false;
+	}
+	if (entry->num_deltas != block->num_deltas || entry->length != block->length)
+	{
+		return false;
+	}
+	return !memcmp(entry->samples, in, block->length * sizeof(sample_t));
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_block_cache_init: Enables the block cache, which lets
+// ssdpcm_search_encode() reuse the encoding of an earlier block with identical
+// input instead of searching again. Up to max_entries blocks are kept; once the cache
+// is full, new blocks are no longer added to it.
+void
+ssdpcm_block_cache_init (size_t max_entries)
+{
+	size_t num_buckets = 1;
+	
+	debug_assert(buckets_ == NULL);
+	debug_assert(max_entries > 0);
+	
+	while (num_buckets < max_entries)
+	{
+		num_buckets <<= 1;
+	}
+	buckets_ = calloc(num_buckets, sizeof(cache_entry_ *));
+	bucket_mask_ = num_buckets - 1;
+	max_entries_ = max_entries;
+	num_entries_ = 0;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_block_cache_enabled: Checks if the block cache has been enabled.
+bool
+ssdpcm_block_cache_enabled (void)
+{
+	return buckets_ != NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_block_cache_lookup: Looks for an earlier block with the same input samples,
+// initial sample, error tracker, length and number of slopes as the given one. If
+// there's one, its slopes and codewords are copied to the block.
+// Returns true if the block was found, along with its error metric.
+bool
+ssdpcm_block_cache_lookup (ssdpcm_block *block, const sample_t *in, sigma_tracker *sigma, uint64_t *metric)
+{
+	uint64_t hash;
+	cache_entry_ *entry;
+	bool found = false;
+	
+	debug_assert(buckets_ != NULL);
+	debug_assert(block != NULL);
+	debug_assert(in != NULL);
+	debug_assert(sigma != NULL);
+	debug_assert(metric != NULL);
+	
+	hash = hash_block_(block, in, sigma->methods);
+#pragma omp critical(ssdpcm_block_cache)
+	{
+		for (entry = buckets_[hash & bucket_mask_]; entry != NULL; entry = entry->next)
+		{
+			if (entry_matches_(entry, hash, block, in, sigma->methods))
+			{
+				memcpy(block->slopes, entry->slopes, block->num_deltas * sizeof(sample_t));
+				memcpy(block->deltas, entry->deltas, block->length * sizeof(codeword_t));
+				*metric = entry->metric;
+				found = true;
+				break;
+			}
+		}
+	}
+	return found;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_block_cache_insert: Adds an encoded block to the cache, along with the
+// input samples it was encoded from and its error metric.
+void
+ssdpcm_block_cache_insert (const ssdpcm_block *block, const sample_t *in, sigma_tracker *sigma, uint64_t metric)
+{
+	uint64_t hash;
+	cache_entry_ *entry;
+	cache_entry_ **bucket;
+	
+	debug_assert(buckets_ != NULL);
+	debug_assert(block != NULL);
+	debug_assert(in != NULL);
+	debug_assert(sigma != NULL);
+	
+	hash = hash_block_(block, in, sigma->methods);
+	entry = malloc(sizeof(cache_entry_));
+	entry->hash = hash;
+	entry->methods = sigma->methods;
+	entry->initial_sample = block->initial_sample;
+	entry->num_deltas = block->num_deltas;
+	entry->length = block->length;
+	entry->metric = metric;
+	entry->samples = malloc(block->length * sizeof(sample_t));
+	entry->slopes = malloc(block->num_deltas * sizeof(sample_t));
+	entry->deltas = malloc(block->length * sizeof(codeword_t));
+	memcpy(entry->samples, in, block->length * sizeof(sample_t));
+	memcpy(entry->slopes, block->slopes, block->num_deltas * sizeof(sample_t));
+	memcpy(entry->deltas, block->deltas, block->length * sizeof(codeword_t));
+
+#pragma omp critical(ssdpcm_block_cache)
+	{
+		bucket = &buckets_[hash & bucket_mask_];
+		// Another thread may have added the same block in the meantime
+		while (*bucket != NULL && !entry_matches_(*bucket, hash, block, in, sigma->methods))
+		{
+			bucket = &(*bucket)->next;
+		}
+		if (*bucket == NULL && num_entries_ < max_entries_)
+		{
+			entry->next = NULL;
+			*bucket = entry;
+			num_entries_++;
+			entry = NULL;
+		}
+	}
+	
+	if (entry != NULL)
+	{
+		free(entry->samples);
+		free(entry->slopes);
+		free(entry->deltas);
+		free(entry);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_block_cache_free: Frees the block cache and disables it.
+void
+ssdpcm_block_cache_free (void)
+{
+	size_t i;
+	cache_entry_ *entry, *next;
+	
+	if (buckets_ == NULL)
+	{
+		return;
+	}
+	for (i = 0; i <= bucket_mask_; i++)
+	{
+		for (entry = buckets_[i]; entry != NULL; entry = next)
+		{
+			next = entry->next;
+			free(entry->samples);
+			free(entry->slopes);
+			free(entry->deltas);
+			free(entry);
+		}
+	}
+	free(buckets_);
+	buckets_ = NULL;
+}
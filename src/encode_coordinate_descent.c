@@ -0,0 +1,112 @@
+/*
+ * ssdpcm: implementation of the SSDPCM audio codec designed by Algorithm.
+ * Copyright (C) 2022-2025 Kagamiin~
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <types.h>
+#include <encode.h>
+#include <errors.h>
+#include <string.h>
+#include <stdio.h>
+#include "encode_search_funcs.h"
+
+// Maximum number of sweeps over all of the slopes done by the coordinate descent.
+#define MAX_COORDINATE_DESCENT_SWEEPS 8
+
+/* ------------------------------------------------------------------------- */
+// Coordinate descent: runs a section search on each slope in turn, with the others
+// held fixed and the slopes kept in decreasing order, and repeats the sweep until none
+// of the slopes move. Starts from the block's current slopes, which must be in strictly
+// decreasing order, so each slope's range holds its current value and can move both ways.
+static inline void
+do_coordinate_descent_ (
+	ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, ssdpcm_block_encode_batch_func encode_batch, ssdpcm_search_stats *stats, sample_t max_abs_delta)
+{
+	int i, sweep;
+	uint8_t half_num_deltas = dest->num_deltas / 2;
+	sample_t *best_slopes;
+	sample_t *candidates;
+	size_t num_candidates = 0;
+	uint64_t best_metric = UINT64_MAX;
+	memo_cache_ memo;
+	
+	best_slopes = calloc(dest->num_deltas, sizeof(sample_t));
+	candidates = calloc(SSDPCM_ENCODE_BATCH_SIZE * dest->num_deltas, sizeof(sample_t));
+	memo_alloc_(&memo, half_num_deltas, max_abs_delta);
+	memcpy(best_slopes, dest->slopes, dest->num_deltas * sizeof(sample_t));
+	
+	queue_candidate_(dest, in, sigma, encode_batch, &memo, stats, candidates, &num_candidates, best_slopes, &best_metric);
+	flush_candidates_(dest, in, sigma, encode_batch, &memo, candidates, &num_candidates, best_slopes, &best_metric);
+	
+	for (sweep = 0; sweep < MAX_COORDINATE_DESCENT_SWEEPS; sweep++)
+	{
+		bool changed = false;
+		for (i = 0; i < half_num_deltas; i++)
+		{
+			sample_t previous = best_slopes[i];
+			sample_t low = i < half_num_deltas - 1 ? best_slopes[i + 1] + 1 : 0;
+			sample_t high = i > 0 ? best_slopes[i - 1] - 1 : max_abs_delta;
+			
+			if (high < previous)
+			{
+				high = previous;
+			}
+			debug_assert(low <= previous);
+			if (low < high)
+			{
+				do_section_search_(dest, in, sigma, encode_batch, &memo, stats, candidates, best_slopes, &best_metric, i, low, high);
+				changed |= best_slopes[i] != previous;
+			}
+		}
+		if (!changed || ssdpcm_search_should_stop())
+		{
+			break;
+		}
+	}
+	
+	free(best_slopes);
+	free(candidates);
+	memo_free_(&memo);
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_encode_coordinate_descent: Encodes an SSDPCM block (given preinitialized
+// fields) optimizing one slope at a time, with the others held fixed, until none of
+// them change. The search starts from the slopes found by clustering the differences
+// between samples (see ssdpcm_encode_kmeans()), so its cost grows about linearly with
+// the number of slopes instead of with a power of it; in exchange, it may settle on a
+// local minimum the grid search would have skipped.
+// Returns the accumulated error metric.
+uint64_t
+ssdpcm_encode_coordinate_descent (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma)
+{
+	sample_t max_abs_delta;
+	ssdpcm_block_encode_func encode;
+	ssdpcm_block_encode_batch_func encode_batch;
+	
+	debug_assert(dest != NULL);
+	debug_assert(in != NULL);
+	debug_assert(sigma != NULL);
+	
+	max_abs_delta = find_max_abs_delta_(dest, in);
+	encode = ssdpcm_block_encode_select(sigma->methods, dest->num_deltas);
+	encode_batch = ssdpcm_block_encode_batch_select(sigma->methods, dest->num_deltas);
+	(void) ssdpcm_encode_kmeans(dest, in, sigma, 0);
+	do_coordinate_descent_(dest, in, sigma, encode_batch, &ssdpcm_search_block_stats, max_abs_delta);
+	
+	return encode(dest, in, sigma, UINT64_MAX);
+}
@@ -0,0 +1,307 @@
+/*
+ * ssdpcm: implementation of the SSDPCM audio codec designed by Algorithm.
+ * Copyright (C) 2022-2025 Kagamiin~
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <types.h>
+#include <encode.h>
+#include <errors.h>
+
+#define COPY_BUFFER_SIZE 65536
+
+// The key is a 128-bit FNV-1a hash, kept as its high and low 64-bit halves. Its prime is
+// 2^88 + 0x13b.
+#define FNV128_OFFSET_BASIS_HIGH 0x6c62272e07bb0142u
+#define FNV128_OFFSET_BASIS_LOW 0x62b821756295c58du
+#define FNV128_PRIME_LOW 0x13bu
+#define FNV128_PRIME_SHIFT 88
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_file_cache_key_init: Starts a key for a file encoded by the given encoder
+// program, with the current SSDPCM_ENCODER_VERSION.
+void
+ssdpcm_file_cache_key_init (ssdpcm_file_cache_key *key, const char *encoder_name)
+{
+	const uint32_t version = SSDPCM_ENCODER_VERSION;
+	
+	debug_assert(key != NULL);
+	debug_assert(encoder_name != NULL);
+	
+	key->hash[0] = FNV128_OFFSET_BASIS_HIGH;
+	key->hash[1] = FNV128_OFFSET_BASIS_LOW;
+	ssdpcm_file_cache_key_add(key, &version, sizeof(version));
+	ssdpcm_file_cache_key_add(key, encoder_name, strlen(encoder_name) + 1);
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_file_cache_key_add: Adds a setting that the encoded file depends on to the key.
+void
+ssdpcm_file_cache_key_add (ssdpcm_file_cache_key *key, const void *data, size_t length)
+{
+	const uint8_t *bytes = data;
+	unsigned __int128 hash = ((unsigned __int128)key->hash[0] << 64) | key->hash[1];
+	size_t i;
+	
+	for (i = 0; i < length; i++)
+	{
+		hash ^= bytes[i];
+		hash = hash * FNV128_PRIME_LOW + (hash << FNV128_PRIME_SHIFT);
+	}
+	key->hash[0] = (uint64_t)(hash >> 64);
+	key->hash[1] = (uint64_t)hash;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_file_cache_key_add_file: Adds the whole contents of a file to the key.
+// Returns false if the file couldn't be read.
+bool
+ssdpcm_file_cache_key_add_file (ssdpcm_file_cache_key *key, const char *path)
+{
+	FILE *file;
+	uint8_t *buffer;
+	size_t length;
+	bool ok;
+	
+	file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		return false;
+	}
+	buffer = malloc(COPY_BUFFER_SIZE);
+	while ((length = fread(buffer, 1, COPY_BUFFER_SIZE, file)) > 0)
+	{
+		ssdpcm_file_cache_key_add(key, buffer, length);
+	}
+	ok = !ferror(file);
+	free(buffer);
+	fclose(file);
+	return ok;
+}
+
+/* ------------------------------------------------------------------------- */
+static char *
+cache_path_ (const char *cache_dir, const ssdpcm_file_cache_key *key, const char *suffix)
+{
+	size_t size = strlen(cache_dir) + strlen(suffix) + 48;
+	char *path = malloc(size);
+	
+	snprintf(path, size, "%s/%016llx%016llx%s", cache_dir, (unsigned long long)key->hash[0], (unsigned long long)key->hash[1], suffix);
+	return path;
+}
+
+static bool
+copy_file_ (const char *src_name, const char *dest_name)
+{
+	FILE *src;
+	FILE *dest;
+	uint8_t *buffer;
+	size_t length;
+	bool ok = true;
+	
+	src = fopen(src_name, "rb");
+	if (src == NULL)
+	{
+		return false;
+	}
+	dest = fopen(dest_name, "wb");
+	if (dest == NULL)
+	{
+		fclose(src);
+		return false;
+	}
+	buffer = malloc(COPY_BUFFER_SIZE);
+	while (ok && (length = fread(buffer, 1, COPY_BUFFER_SIZE, src)) > 0)
+	{
+		ok = fwrite(buffer, 1, length, dest) == length;
+	}
+	ok = ok && !ferror(src);
+	free(buffer);
+	fclose(src);
+	ok = !fclose(dest) && ok;
+	if (!ok)
+	{
+		remove(dest_name);
+	}
+	return ok;
+}
+
+/* ------------------------------------------------------------------------- */
+// Reads the size of the input file and a hash of its contents alone into its
+// description, as stored next to each cached file. Unlike the key, this hash doesn't
+// cover the encoder settings, and it doesn't depend on the file's modification time, so
+// fresh checkouts of the same input still hit the cache.
+// Returns false if the file couldn't be read.
+static bool
+describe_input_ (const char *infile_name, char *description, size_t size)
+{
+	ssdpcm_file_cache_key contents;
+	struct stat info;
+	
+	if (stat(infile_name, &info) != 0)
+	{
+		return false;
+	}
+	contents.hash[0] = FNV128_OFFSET_BASIS_HIGH;
+	contents.hash[1] = FNV128_OFFSET_BASIS_LOW;
+	if (!ssdpcm_file_cache_key_add_file(&contents, infile_name))
+	{
+		return false;
+	}
+	snprintf(description, size, "%lld %016llx%016llx\n", (long long)info.st_size, (unsigned long long)contents.hash[0], (unsigned long long)contents.hash[1]);
+	return true;
+}
+
+/* ------------------------------------------------------------------------- */
+// Checks that the description stored next to a cached file matches the input file, so
+// that a hash collision, however unlikely, can't serve a file encoded from another input.
+static bool
+check_input_ (const char *cache_dir, const ssdpcm_file_cache_key *key, const char *infile_name)
+{
+	char expected[64];
+	char stored[64] = {0};
+	char *path;
+	FILE *file;
+	bool ok;
+	
+	if (!describe_input_(infile_name, expected, sizeof(expected)))
+	{
+		return false;
+	}
+	path = cache_path_(cache_dir, key, ".input");
+	file = fopen(path, "rb");
+	free(path);
+	if (file == NULL)
+	{
+		return false;
+	}
+	ok = fread(stored, 1, sizeof(stored) - 1, file) > 0 && !strcmp(stored, expected);
+	fclose(file);
+	return ok;
+}
+
+/* ------------------------------------------------------------------------- */
+// Stores the description of the input file next to a cached file, through a temporary
+// file like the cached file itself.
+static bool
+store_input_ (const char *cache_dir, const ssdpcm_file_cache_key *key, const char *infile_name, const char *temp_suffix)
+{
+	char description[64];
+	char *temp_path;
+	char *path;
+	FILE *file;
+	bool ok;
+	
+	if (!describe_input_(infile_name, description, sizeof(description)))
+	{
+		return false;
+	}
+	temp_path = cache_path_(cache_dir, key, temp_suffix);
+	path = cache_path_(cache_dir, key, ".input");
+	file = fopen(temp_path, "wb");
+	ok = file != NULL;
+	if (ok)
+	{
+		ok = fputs(description, file) >= 0;
+		ok = !fclose(file) && ok;
+	}
+	if (ok && rename(temp_path, path) != 0)
+	{
+		ok = false;
+	}
+	if (!ok)
+	{
+		remove(temp_path);
+	}
+	free(temp_path);
+	free(path);
+	return ok;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_file_cache_fetch: Looks for a file encoded with the given key in the cache
+// directory, and copies it to outfile_name if there's one. The input file's size and
+// contents hash must also match the ones stored with the cached file.
+// Returns true if the cached file was copied; the file has to be encoded otherwise.
+bool
+ssdpcm_file_cache_fetch (const char *cache_dir, const ssdpcm_file_cache_key *key, const char *infile_name, const char *outfile_name)
+{
+	char *path;
+	bool found;
+	
+	debug_assert(cache_dir != NULL);
+	debug_assert(key != NULL);
+	debug_assert(infile_name != NULL);
+	debug_assert(outfile_name != NULL);
+	
+	if (!check_input_(cache_dir, key, infile_name))
+	{
+		return false;
+	}
+	path = cache_path_(cache_dir, key, ".aud");
+	found = copy_file_(path, outfile_name);
+	free(path);
+	return found;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_file_cache_store: Stores a copy of the file just encoded with the given key
+// in the cache directory, creating the directory if needed. The copy is written to a
+// temporary file first and then renamed, so that concurrent builds sharing the
+// directory never see a partially written file. The input file's size and contents
+// hash are stored next to it.
+// Returns false if the file couldn't be stored.
+bool
+ssdpcm_file_cache_store (const char *cache_dir, const ssdpcm_file_cache_key *key, const char *infile_name, const char *outfile_name)
+{
+	char suffix[32];
+	char *temp_path;
+	char *path;
+	bool ok;
+	
+	debug_assert(cache_dir != NULL);
+	debug_assert(key != NULL);
+	debug_assert(infile_name != NULL);
+	debug_assert(outfile_name != NULL);
+	
+	if (mkdir(cache_dir, 0777) != 0 && errno != EEXIST)
+	{
+		return false;
+	}
+	snprintf(suffix, sizeof(suffix), ".input.%ld.tmp", (long)getpid());
+	if (!store_input_(cache_dir, key, infile_name, suffix))
+	{
+		return false;
+	}
+	snprintf(suffix, sizeof(suffix), ".aud.%ld.tmp", (long)getpid());
+	temp_path = cache_path_(cache_dir, key, suffix);
+	path = cache_path_(cache_dir, key, ".aud");
+	ok = copy_file_(outfile_name, temp_path);
+	if (ok && rename(temp_path, path) != 0)
+	{
+		remove(temp_path);
+		ok = false;
+	}
+	free(temp_path);
+	free(path);
+	return ok;
+}
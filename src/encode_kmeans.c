@@ -0,0 +1,271 @@
+/*
+ * ssdpcm: implementation of the SSDPCM audio codec designed by Algorithm.
+ * Copyright (C) 2022-2025 Kagamiin~
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <types.h>
+#include <encode.h>
+#include <errors.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+// Maximum number of Lloyd iterations when clustering the deltas of a block.
+#define KMEANS_MAX_ITERATIONS 32
+
+static int
+compare_samples_ (const void *a, const void *b)
+{
+	sample_t x = *(const sample_t *)a;
+	sample_t y = *(const sample_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* ------------------------------------------------------------------------- */
+// Turns the slope magnitudes into a valid set of slopes for the block: sorted in
+// decreasing order with no repeats, mirrored into the negative slopes, and with
+// the zero slope at the end for an odd number of deltas.
+// Repeated magnitudes are pushed down, and if that takes the smallest ones below 1,
+// they're spread back up so every positive slope is at least 1 and none of the slopes
+// repeat, not even the zero slope.
+static inline void
+set_block_slopes_ (ssdpcm_block *dest, sample_t *magnitudes, uint8_t half_num_deltas)
+{
+	int i;
+	
+	qsort(magnitudes, half_num_deltas, sizeof(sample_t), &compare_samples_);
+	for (i = 0; i < half_num_deltas; i++)
+	{
+		dest->slopes[i] = magnitudes[half_num_deltas - i - 1];
+		if (i > 0 && dest->slopes[i] >= dest->slopes[i - 1])
+		{
+			dest->slopes[i] = dest->slopes[i - 1] - 1;
+		}
+	}
+	for (i = half_num_deltas - 1; i >= 0; i--)
+	{
+		sample_t min_slope = (i == half_num_deltas - 1) ? 1 : dest->slopes[i + 1] + 1;
+		if (dest->slopes[i] < min_slope)
+		{
+			dest->slopes[i] = min_slope;
+		}
+		dest->slopes[i + half_num_deltas] = -dest->slopes[i];
+	}
+	if (dest->num_deltas & 1)
+	{
+		dest->slopes[dest->num_deltas - 1] = 0;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+// Clusters the absolute differences between successive samples into as many
+// magnitudes as there are positive slopes, using Lloyd's algorithm seeded by a
+// median cut of the sorted differences. With an odd number of deltas, an extra
+// cluster is pinned at zero, which is what the zero slope encodes.
+static inline void
+cluster_deltas_ (ssdpcm_block *dest, sample_t *in, sample_t *magnitudes, uint8_t half_num_deltas)
+{
+	size_t i, n = dest->length;
+	int j, iteration;
+	bool pin_zero = dest->num_deltas & 1;
+	sample_t *deltas = malloc(n * sizeof(sample_t));
+	double *centroids = malloc(half_num_deltas * sizeof(double));
+	double *sums = malloc(half_num_deltas * sizeof(double));
+	size_t *counts = malloc(half_num_deltas * sizeof(size_t));
+	
+	for (i = 0; i < n; i++)
+	{
+		deltas[i] = in[i] - (i > 0 ? in[i - 1] : dest->initial_sample);
+		if (deltas[i] < 0)
+		{
+			deltas[i] = -deltas[i];
+		}
+	}
+	qsort(deltas, n, sizeof(sample_t), &compare_samples_);
+	
+	// Median cut: split the sorted differences into groups of the same size
+	for (j = 0; j < half_num_deltas; j++)
+	{
+		size_t start = j * n / half_num_deltas;
+		size_t end = (j + 1) * n / half_num_deltas;
+		double sum = 0;
+		for (i = start; i < end; i++)
+		{
+			sum += deltas[i];
+		}
+		centroids[j] = end > start ? sum / (end - start) : deltas[start < n ? start : n - 1];
+	}
+	
+	for (iteration = 0; iteration < KMEANS_MAX_ITERATIONS; iteration++)
+	{
+		bool changed = false;
+		
+		memset(sums, 0, half_num_deltas * sizeof(double));
+		memset(counts, 0, half_num_deltas * sizeof(size_t));
+		for (i = 0; i < n; i++)
+		{
+			double best_distance = pin_zero ? deltas[i] : INFINITY;
+			int best = -1;
+			for (j = 0; j < half_num_deltas; j++)
+			{
+				double distance = fabs(deltas[i] - centroids[j]);
+				if (distance < best_distance)
+				{
+					best_distance = distance;
+					best = j;
+				}
+			}
+			if (best >= 0)
+			{
+				sums[best] += deltas[i];
+				counts[best]++;
+			}
+		}
+		for (j = 0; j < half_num_deltas; j++)
+		{
+			if (counts[j] > 0 && sums[j] / counts[j] != centroids[j])
+			{
+				centroids[j] = sums[j] / counts[j];
+				changed = true;
+			}
+		}
+		if (!changed)
+		{
+			break;
+		}
+	}
+	
+	for (j = 0; j < half_num_deltas; j++)
+	{
+		magnitudes[j] = lround(centroids[j]);
+	}
+	
+	free(deltas);
+	free(centroids);
+	free(sums);
+	free(counts);
+}
+
+/* ------------------------------------------------------------------------- */
+// Re-estimates each slope as the mean of the differences it was chosen to encode,
+// measured against the decoded samples rather than the input samples. Slopes that
+// weren't chosen at all are left as they were.
+// Returns true if any of the slopes changed.
+static inline bool
+refit_slopes_ (ssdpcm_block *dest, sample_t *in, sample_t *decoded, sample_t *magnitudes, uint8_t half_num_deltas)
+{
+	size_t i;
+	int j;
+	bool changed = false;
+	int64_t *sums = calloc(half_num_deltas, sizeof(int64_t));
+	size_t *counts = calloc(half_num_deltas, sizeof(size_t));
+	
+	ssdpcm_block_decode(decoded, dest);
+	for (i = 0; i < dest->length; i++)
+	{
+		codeword_t c = dest->deltas[i];
+		sample_t previous = i > 0 ? decoded[i - 1] : dest->initial_sample;
+		if (c < half_num_deltas)
+		{
+			sums[c] += in[i] - previous;
+			counts[c]++;
+		}
+		else if (c < 2 * half_num_deltas)
+		{
+			sums[c - half_num_deltas] += previous - in[i];
+			counts[c - half_num_deltas]++;
+		}
+	}
+	
+	for (j = 0; j < half_num_deltas; j++)
+	{
+		magnitudes[j] = dest->slopes[j];
+		if (counts[j] > 0)
+		{
+			sample_t slope = llround((double)sums[j] / counts[j]);
+			if (slope < 0)
+			{
+				slope = 0;
+			}
+			changed |= slope != magnitudes[j];
+			magnitudes[j] = slope;
+		}
+	}
+	
+	free(sums);
+	free(counts);
+	return changed;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_encode_kmeans: Encodes an SSDPCM block (given preinitialized fields)
+// with slopes found by clustering the differences between successive samples,
+// instead of searching for them. Then, up to refine_iterations times, the slopes
+// are refitted to the codewords chosen by the encoder and the block is encoded
+// again, keeping the best set of slopes.
+// Returns the accumulated error metric.
+uint64_t
+ssdpcm_encode_kmeans (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, unsigned int refine_iterations)
+{
+	unsigned int i;
+	uint8_t half_num_deltas = dest->num_deltas / 2;
+	uint64_t best_metric;
+	sample_t *magnitudes;
+	sample_t *best_slopes;
+	sample_t *decoded;
+	ssdpcm_block_encode_func encode;
+	
+	debug_assert(dest != NULL);
+	debug_assert(in != NULL);
+	debug_assert(sigma != NULL);
+	
+	encode = ssdpcm_block_encode_select(sigma->methods, dest->num_deltas);
+	magnitudes = calloc(half_num_deltas, sizeof(sample_t));
+	best_slopes = calloc(dest->num_deltas, sizeof(sample_t));
+	decoded = calloc(dest->length, sizeof(sample_t));
+	
+	cluster_deltas_(dest, in, magnitudes, half_num_deltas);
+	set_block_slopes_(dest, magnitudes, half_num_deltas);
+	best_metric = encode(dest, in, sigma, UINT64_MAX);
+	ssdpcm_search_block_stats.candidates++;
+	ssdpcm_search_report_metric(best_metric);
+	memcpy(best_slopes, dest->slopes, dest->num_deltas * sizeof(sample_t));
+	
+	for (i = 0; i < refine_iterations; i++)
+	{
+		uint64_t sigma_metric;
+		if (ssdpcm_search_should_stop() || !refit_slopes_(dest, in, decoded, magnitudes, half_num_deltas))
+		{
+			break;
+		}
+		set_block_slopes_(dest, magnitudes, half_num_deltas);
+		sigma_metric = encode(dest, in, sigma, UINT64_MAX);
+		ssdpcm_search_block_stats.candidates++;
+		if (sigma_metric < best_metric)
+		{
+			best_metric = sigma_metric;
+			ssdpcm_search_report_metric(best_metric);
+			memcpy(best_slopes, dest->slopes, dest->num_deltas * sizeof(sample_t));
+		}
+	}
+	
+	memcpy(dest->slopes, best_slopes, dest->num_deltas * sizeof(sample_t));
+	free(magnitudes);
+	free(best_slopes);
+	free(decoded);
+	return encode(dest, in, sigma, UINT64_MAX);
+}
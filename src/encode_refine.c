@@ -0,0 +1,167 @@
+/*
+ * ssdpcm: implementation of the SSDPCM audio codec designed by Algorithm.
+ * Copyright (C) 2022-2025 Kagamiin~
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <types.h>
+#include <encode.h>
+#include <errors.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+/* ------------------------------------------------------------------------- */
+// xorshift64* generator; the refinement needs to be repeatable, not good random numbers.
+static inline uint64_t
+refine_random_ (uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545f4914f6cdd1du;
+}
+
+// Uniformly distributed in [0, 1).
+static inline double
+refine_random_unit_ (uint64_t *state)
+{
+	return (refine_random_(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static inline uint64_t
+elapsed_microseconds_ (const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* ------------------------------------------------------------------------- */
+// Mutates one of the positive slopes at random, by up to a quarter of its value (and
+// at least by 1), keeping the slopes in decreasing order with no repeats.
+// Returns false if the mutation couldn't produce a valid set of slopes.
+static inline bool
+mutate_slopes_ (sample_t *slopes, uint8_t num_deltas, uint64_t *random_state)
+{
+	uint8_t half_num_deltas = num_deltas / 2;
+	int i = refine_random_(random_state) % half_num_deltas;
+	double amplitude = 1 + slopes[i] / 4.0;
+	sample_t step = lround((2 * refine_random_unit_(random_state) - 1) * amplitude);
+	
+	if (step == 0)
+	{
+		step = (refine_random_(random_state) & 1) ? 1 : -1;
+	}
+	slopes[i] += step;
+	if (slopes[i] < 0 || (i > 0 && slopes[i] >= slopes[i - 1]) || (i < half_num_deltas - 1 && slopes[i] <= slopes[i + 1]))
+	{
+		return false;
+	}
+	slopes[i + half_num_deltas] = -slopes[i];
+	return true;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_encode_refine: Refines the slopes of an SSDPCM block that was already
+// encoded by another strategy, given as input:
+// - A sample buffer
+// - An error tracker (with preallocated state)
+// - The refinement parameters.
+// One of the slopes is mutated at random on each iteration and the block is
+// encoded again. Mutations that lower the error metric are always kept; when
+// annealing, worse ones are kept with a probability that drops as the
+// temperature cools down over the iteration budget. The best set of slopes
+// found is kept.
+// Returns the accumulated error metric.
+uint64_t
+ssdpcm_encode_refine (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, const ssdpcm_refine_params *params)
+{
+	unsigned int i;
+	uint64_t best_metric, current_metric;
+	uint64_t random_state = 0x9e3779b97f4a7c15u ^ (uint64_t)dest->initial_sample;
+	sample_t *best_slopes;
+	sample_t *current_slopes;
+	ssdpcm_block_encode_func encode;
+	struct timespec start;
+	
+	debug_assert(dest != NULL);
+	debug_assert(in != NULL);
+	debug_assert(sigma != NULL);
+	debug_assert(params != NULL);
+	
+	encode = ssdpcm_block_encode_select(sigma->methods, dest->num_deltas);
+	if (dest->num_deltas < 2)
+	{
+		return encode(dest, in, sigma, UINT64_MAX);
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	best_slopes = calloc(dest->num_deltas, sizeof(sample_t));
+	current_slopes = calloc(dest->num_deltas, sizeof(sample_t));
+	memcpy(best_slopes, dest->slopes, dest->num_deltas * sizeof(sample_t));
+	memcpy(current_slopes, dest->slopes, dest->num_deltas * sizeof(sample_t));
+	best_metric = encode(dest, in, sigma, UINT64_MAX);
+	current_metric = best_metric;
+	ssdpcm_search_block_stats.candidates++;
+	ssdpcm_search_report_metric(best_metric);
+	
+	for (i = 0; i < params->max_iterations; i++)
+	{
+		uint64_t sigma_metric;
+		uint64_t acceptance_bound = current_metric;
+		double temperature = params->temperature * (params->max_iterations - i) / params->max_iterations;
+		
+		if ((params->max_microseconds && elapsed_microseconds_(&start) >= params->max_microseconds) || ssdpcm_search_should_stop())
+		{
+			break;
+		}
+		
+		memcpy(dest->slopes, current_slopes, dest->num_deltas * sizeof(sample_t));
+		if (!mutate_slopes_(dest->slopes, dest->num_deltas, &random_state))
+		{
+			continue;
+		}
+		
+		// Metropolis criterion, drawn before encoding so that the worst acceptable
+		// metric can be used as the error bound
+		if (temperature > 0)
+		{
+			double threshold = -log(1 - refine_random_unit_(&random_state)) * temperature * current_metric;
+			acceptance_bound = threshold < (double)(UINT64_MAX - current_metric) ? current_metric + (uint64_t)threshold : UINT64_MAX;
+		}
+		
+		sigma_metric = encode(dest, in, sigma, acceptance_bound);
+		ssdpcm_search_block_stats.candidates++;
+		if (sigma_metric < acceptance_bound)
+		{
+			current_metric = sigma_metric;
+			memcpy(current_slopes, dest->slopes, dest->num_deltas * sizeof(sample_t));
+			if (sigma_metric < best_metric)
+			{
+				best_metric = sigma_metric;
+				ssdpcm_search_report_metric(best_metric);
+				memcpy(best_slopes, dest->slopes, dest->num_deltas * sizeof(sample_t));
+			}
+		}
+	}
+	
+	memcpy(dest->slopes, best_slopes, dest->num_deltas * sizeof(sample_t));
+	free(best_slopes);
+	free(current_slopes);
+	return encode(dest, in, sigma, UINT64_MAX);
+}
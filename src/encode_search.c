@@ -0,0 +1,545 @@
+/*
+ * ssdpcm: implementation of the SSDPCM audio codec designed by Algorithm.
+ * Copyright (C) 2022-2025 Kagamiin~
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <types.h>
+#include <encode.h>
+#include <errors.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <math.h>
+
+// Grid of the coarse search that the refine strategy starts from.
+#define REFINE_GRID_BITS 2
+
+// Refinement iterations of the kmeans strategy.
+#define KMEANS_ITERATIONS 4
+
+// Mutations tried when refining a speculated block for its real initial sample.
+#define SPECULATION_REFINE_ITERATIONS 48
+
+// A refined speculated block is searched again if its error is more than
+// 1/SPECULATION_MAX_EXTRA_ERROR above the error the speculation found.
+#define SPECULATION_MAX_EXTRA_ERROR 8
+
+#define NUM_STRATEGIES_ 6
+
+// Column the descriptions of the strategies start at in the usage text, and the width
+// they're wrapped to.
+#define USAGE_DESCRIPTION_COLUMN 20
+#define USAGE_WIDTH 76
+
+ssdpcm_search_stats ssdpcm_search_block_stats;
+
+static ssdpcm_search_stats strategy_stats_[NUM_STRATEGIES_];
+
+static ssdpcm_search_budget budget_;
+
+// Time the search of the calling thread's current block started at.
+static struct timespec block_start_;
+#pragma omp threadprivate(block_start_)
+
+// Target error of the calling thread's current block, if it has one.
+static bool block_has_target_;
+static uint64_t block_target_;
+#pragma omp threadprivate(block_has_target_, block_target_)
+
+// Candidates encoded and time taken by the calling thread's searches so far.
+static uint64_t thread_candidates_, thread_nanoseconds_;
+#pragma omp threadprivate(thread_candidates_, thread_nanoseconds_)
+
+/* ------------------------------------------------------------------------- */
+static uint64_t
+encode_kmeans_ (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma)
+{
+	return ssdpcm_encode_kmeans(dest, in, sigma, KMEANS_ITERATIONS);
+}
+
+static uint64_t
+encode_refine_ (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma)
+{
+	static const ssdpcm_refine_params params =
+	{
+		.max_iterations = 64,
+		.max_microseconds = 0,
+		.temperature = 0.05
+	};
+	
+	(void) ssdpcm_encode_binary_search_grid(dest, in, sigma, REFINE_GRID_BITS);
+	return ssdpcm_encode_refine(dest, in, sigma, &params);
+}
+
+/* ------------------------------------------------------------------------- */
+static const struct ssdpcm_search_methods_s bruteforce_ =
+{
+	"bruteforce",
+	"tries every set of slopes (extremely slow)",
+	&ssdpcm_encode_bruteforce,
+	false
+};
+
+static const struct ssdpcm_search_methods_s binary_search_ =
+{
+	"binary",
+	"multilevel grid search over the slopes (default)",
+	&ssdpcm_encode_binary_search,
+	false
+};
+
+static const struct ssdpcm_search_methods_s binary_search_warm_ =
+{
+	"binary-warm",
+	"grid search around the previous block's slopes",
+	&ssdpcm_encode_binary_search_warm,
+	true
+};
+
+static const struct ssdpcm_search_methods_s kmeans_ =
+{
+	"kmeans",
+	"clusters the differences between samples, no search (fastest)",
+	&encode_kmeans_,
+	false
+};
+
+static const struct ssdpcm_search_methods_s refine_ =
+{
+	"refine",
+	"coarse grid search followed by hill-climbing",
+	&encode_refine_,
+	false
+};
+
+static const struct ssdpcm_search_methods_s coordinate_descent_ =
+{
+	"coordinate",
+	"optimizes one slope at a time, starting from the clustered slopes",
+	&ssdpcm_encode_coordinate_descent,
+	false
+};
+
+ssdpcm_search_methods ssdpcm_search_bruteforce = &bruteforce_;
+ssdpcm_search_methods ssdpcm_search_binary_search = &binary_search_;
+ssdpcm_search_methods ssdpcm_search_binary_search_warm = &binary_search_warm_;
+ssdpcm_search_methods ssdpcm_search_kmeans = &kmeans_;
+ssdpcm_search_methods ssdpcm_search_refine = &refine_;
+ssdpcm_search_methods ssdpcm_search_coordinate_descent = &coordinate_descent_;
+
+const ssdpcm_search_methods ssdpcm_search_strategies[NUM_STRATEGIES_ + 1] =
+{
+	&binary_search_,
+	&binary_search_warm_,
+	&coordinate_descent_,
+	&refine_,
+	&kmeans_,
+	&bruteforce_,
+	NULL
+};
+
+/* ------------------------------------------------------------------------- */
+static inline ssdpcm_search_stats *
+find_strategy_stats_ (ssdpcm_search_methods search)
+{
+	int i;
+	for (i = 0; i < NUM_STRATEGIES_; i++)
+	{
+		if (ssdpcm_search_strategies[i] == search)
+		{
+			return &strategy_stats_[i];
+		}
+	}
+	assert(!"unregistered search strategy");
+	return NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+// Sets the target error of the block about to be searched from the budget.
+static inline void
+set_block_target_ (ssdpcm_block *dest, sample_t *in)
+{
+	block_has_target_ = budget_.target_error != 0;
+	block_target_ = budget_.target_error;
+	
+	if (budget_.target_snr_db != 0)
+	{
+		double mean = 0;
+		double energy = 0;
+		double snr_target;
+		size_t i;
+		
+		for (i = 0; i < dest->length; i++)
+		{
+			mean += in[i];
+		}
+		mean /= dest->length;
+		for (i = 0; i < dest->length; i++)
+		{
+			energy += (in[i] - mean) * (in[i] - mean);
+		}
+		
+		snr_target = energy * pow(10, -budget_.target_snr_db / 10);
+		if (!block_has_target_ || snr_target > block_target_)
+		{
+			block_target_ = snr_target;
+		}
+		block_has_target_ = true;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_search_find: Looks up a search strategy by its name.
+// Returns NULL if there's no strategy with that name.
+ssdpcm_search_methods
+ssdpcm_search_find (const char *name)
+{
+	int i;
+	
+	debug_assert(name != NULL);
+	
+	for (i = 0; ssdpcm_search_strategies[i] != NULL; i++)
+	{
+		if (!strcmp(ssdpcm_search_strategies[i]->name, name))
+		{
+			return ssdpcm_search_strategies[i];
+		}
+	}
+	return NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_search_print_strategies: Prints the list of search strategies for the usage
+// text to stderr, one per line, with the descriptions wrapped to fit. Strategies that
+// need the blocks to be encoded in order are left out unless include_sequential is set.
+void
+ssdpcm_search_print_strategies (bool include_sequential)
+{
+	int i;
+	
+	for (i = 0; ssdpcm_search_strategies[i] != NULL; i++)
+	{
+		const char *name = ssdpcm_search_strategies[i]->name;
+		const char *word = ssdpcm_search_strategies[i]->description;
+		int column = USAGE_DESCRIPTION_COLUMN;
+		
+		if (ssdpcm_search_strategies[i]->sequential && !include_sequential)
+		{
+			continue;
+		}
+		fprintf(stderr, "    - \033[96m%s\033[0m%*s- ", name, (int)(USAGE_DESCRIPTION_COLUMN - 8 - strlen(name)), "");
+		while (*word != '\0')
+		{
+			int length = strcspn(word, " ");
+			if (column > USAGE_DESCRIPTION_COLUMN && column + 1 + length > USAGE_WIDTH)
+			{
+				fprintf(stderr, "\n%*s", USAGE_DESCRIPTION_COLUMN, "");
+				column = USAGE_DESCRIPTION_COLUMN;
+			}
+			else if (column > USAGE_DESCRIPTION_COLUMN)
+			{
+				fputc(' ', stderr);
+				column++;
+			}
+			fprintf(stderr, "%.*s", length, word);
+			column += length;
+			word += length + strspn(word + length, " ");
+		}
+		fputc('\n', stderr);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+// Starts counting the candidates and time of the calling thread's next block.
+static inline void
+begin_block_ (ssdpcm_block *dest, sample_t *in)
+{
+	memset(&ssdpcm_search_block_stats, 0, sizeof(ssdpcm_search_stats));
+	set_block_target_(dest, in);
+	clock_gettime(CLOCK_MONOTONIC, &block_start_);
+}
+
+// Adds the candidates and time of the calling thread's block to the strategy's counters.
+static inline void
+end_block_ (ssdpcm_search_stats *stats, bool new_block)
+{
+	struct timespec end;
+	uint64_t elapsed;
+	
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - block_start_.tv_sec) * 1000000000 + (end.tv_nsec - block_start_.tv_nsec);
+	thread_candidates_ += ssdpcm_search_block_stats.candidates - ssdpcm_search_block_stats.memo_hits;
+	thread_nanoseconds_ += elapsed;
+
+#pragma omp atomic
+	stats->blocks += new_block;
+#pragma omp atomic
+	stats->candidates += ssdpcm_search_block_stats.candidates;
+#pragma omp atomic
+	stats->memo_hits += ssdpcm_search_block_stats.memo_hits;
+#pragma omp atomic
+	stats->nanoseconds += elapsed;
+#pragma omp atomic
+	stats->out_of_budget += ssdpcm_search_block_stats.out_of_budget;
+#pragma omp atomic
+	stats->target_reached += ssdpcm_search_block_stats.target_reached;
+#pragma omp atomic
+	stats->flat_blocks += ssdpcm_search_block_stats.flat_blocks;
+#pragma omp atomic
+	stats->cache_hits += ssdpcm_search_block_stats.cache_hits;
+#pragma omp atomic
+	stats->speculation_refined += ssdpcm_search_block_stats.speculation_refined;
+#pragma omp atomic
+	stats->speculation_redone += ssdpcm_search_block_stats.speculation_redone;
+}
+
+static inline uint64_t
+search_block_ (ssdpcm_search_methods search, ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma)
+{
+	uint64_t metric;
+	
+	if (ssdpcm_encode_flat_block(dest, in, sigma))
+	{
+		metric = 0;
+	}
+	else if (ssdpcm_block_cache_enabled() && ssdpcm_block_cache_lookup(dest, in, sigma, &metric))
+	{
+		ssdpcm_search_block_stats.cache_hits = 1;
+	}
+	else
+	{
+		metric = search->encode(dest, in, sigma);
+		if (ssdpcm_block_cache_enabled())
+		{
+			ssdpcm_block_cache_insert(dest, in, sigma, metric);
+		}
+	}
+	return metric;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_search_encode: Encodes an SSDPCM block (given preinitialized fields) with
+// the slopes found by the given search strategy, adding the candidates it visited
+// and the time it took to the strategy's counters. Blocks that are flat enough skip
+// the search (see ssdpcm_encode_flat_block()), whatever the strategy, and so do
+// blocks found in the block cache, if it's enabled.
+// Returns the accumulated error metric.
+uint64_t
+ssdpcm_search_encode (ssdpcm_search_methods search, ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma)
+{
+	uint64_t metric;
+	
+	debug_assert(search != NULL);
+	
+	begin_block_(dest, in);
+	metric = search_block_(search, dest, in, sigma);
+	end_block_(find_strategy_stats_(search), true);
+	return metric;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_search_encode_speculated: Encodes an SSDPCM block (given preinitialized
+// fields) that was already encoded by ssdpcm_search_encode() ahead of time, from a
+// guess of its initial sample if guessed is set, now that the real initial sample is
+// known:
+// - If the guess was right, the speculated block is used as is.
+// - Otherwise, the speculated slopes are refined with a short hill-climb for the real
+//   initial sample, unless the error ends up well above the speculated one; then the
+//   block is searched again from scratch.
+// The block isn't counted again in the strategy's counters, but the candidates and
+// time spent on it are.
+// Returns the accumulated error metric.
+uint64_t
+ssdpcm_search_encode_speculated (
+	ssdpcm_search_methods search, ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, const ssdpcm_block *speculated, uint64_t speculated_metric, bool guessed)
+{
+	static const ssdpcm_refine_params params =
+	{
+		.max_iterations = SPECULATION_REFINE_ITERATIONS,
+		.max_microseconds = 0,
+		.temperature = 0
+	};
+	ssdpcm_search_stats *stats;
+	uint64_t metric;
+	
+	debug_assert(search != NULL);
+	debug_assert(speculated != NULL);
+	debug_assert(speculated->num_deltas == dest->num_deltas && speculated->length == dest->length);
+	
+	debug_assert(guessed || speculated->initial_sample == dest->initial_sample);
+	
+	stats = find_strategy_stats_(search);
+	if (guessed)
+	{
+#pragma omp atomic
+		stats->speculation_guesses++;
+	}
+	memcpy(dest->slopes, speculated->slopes, dest->num_deltas * sizeof(sample_t));
+	if (speculated->initial_sample == dest->initial_sample)
+	{
+		memcpy(dest->deltas, speculated->deltas, dest->length * sizeof(codeword_t));
+		if (guessed)
+		{
+#pragma omp atomic
+			stats->speculation_hits++;
+		}
+		return speculated_metric;
+	}
+	
+	begin_block_(dest, in);
+	metric = ssdpcm_encode_refine(dest, in, sigma, &params);
+	if (metric <= speculated_metric + speculated_metric / SPECULATION_MAX_EXTRA_ERROR)
+	{
+		ssdpcm_search_block_stats.speculation_refined = 1;
+		end_block_(stats, false);
+		return metric;
+	}
+	end_block_(stats, false);
+	
+	begin_block_(dest, in);
+	metric = search_block_(search, dest, in, sigma);
+	ssdpcm_search_block_stats.speculation_redone = 1;
+	end_block_(stats, false);
+	return metric;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_search_get_stats: Gets the counters of a search strategy, accumulated
+// over all blocks it encoded so far.
+void
+ssdpcm_search_get_stats (ssdpcm_search_methods search, ssdpcm_search_stats *stats)
+{
+	ssdpcm_search_stats *strategy_stats;
+	
+	debug_assert(search != NULL);
+	debug_assert(stats != NULL);
+	
+	strategy_stats = find_strategy_stats_(search);
+#pragma omp atomic read
+	stats->blocks = strategy_stats->blocks;
+#pragma omp atomic read
+	stats->candidates = strategy_stats->candidates;
+#pragma omp atomic read
+	stats->memo_hits = strategy_stats->memo_hits;
+#pragma omp atomic read
+	stats->nanoseconds = strategy_stats->nanoseconds;
+#pragma omp atomic read
+	stats->out_of_budget = strategy_stats->out_of_budget;
+#pragma omp atomic read
+	stats->target_reached = strategy_stats->target_reached;
+#pragma omp atomic read
+	stats->flat_blocks = strategy_stats->flat_blocks;
+#pragma omp atomic read
+	stats->cache_hits = strategy_stats->cache_hits;
+#pragma omp atomic read
+	stats->speculation_guesses = strategy_stats->speculation_guesses;
+#pragma omp atomic read
+	stats->speculation_hits = strategy_stats->speculation_hits;
+#pragma omp atomic read
+	stats->speculation_refined = strategy_stats->speculation_refined;
+#pragma omp atomic read
+	stats->speculation_redone = strategy_stats->speculation_redone;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_search_set_budget: Sets the limits on the search of each block encoded
+// through ssdpcm_search_encode(). Must not be called while blocks are being encoded.
+void
+ssdpcm_search_set_budget (const ssdpcm_search_budget *budget)
+{
+	debug_assert(budget != NULL);
+	
+	budget_ = *budget;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_search_is_limited: Checks if the budget set with ssdpcm_search_set_budget()
+// limits the searches at all.
+bool
+ssdpcm_search_is_limited (void)
+{
+	return budget_.max_candidates || budget_.max_nanoseconds || budget_.target_error || budget_.target_snr_db != 0;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_search_candidate_budget: Estimates how many candidates the search of the
+// calling thread's current block can encode within the budget, so that the search can
+// be planned to fit; a deadline is converted with the average time per candidate of
+// the blocks the thread searched so far. Returns 0 if there's no limit (or no estimate
+// yet).
+uint64_t
+ssdpcm_search_candidate_budget (void)
+{
+	uint64_t max_candidates = budget_.max_candidates;
+	
+	if (budget_.max_nanoseconds && thread_candidates_)
+	{
+		uint64_t deadline_candidates = budget_.max_nanoseconds * thread_candidates_ / thread_nanoseconds_;
+		if (!max_candidates || deadline_candidates < max_candidates)
+		{
+			max_candidates = deadline_candidates ? deadline_candidates : 1;
+		}
+	}
+	return max_candidates;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_search_should_stop: Checks if the search of the calling thread's current
+// block has used up its budget or met its target error. The searches call this as
+// they go, and once it returns true, they stop and keep the best slopes found so far;
+// it keeps returning true until the next block.
+bool
+ssdpcm_search_should_stop (void)
+{
+	struct timespec now;
+	uint64_t elapsed;
+	
+	if (ssdpcm_search_block_stats.out_of_budget || ssdpcm_search_block_stats.target_reached)
+	{
+		return true;
+	}
+	if (budget_.max_candidates && ssdpcm_search_block_stats.candidates - ssdpcm_search_block_stats.memo_hits >= budget_.max_candidates)
+	{
+		ssdpcm_search_block_stats.out_of_budget = 1;
+		return true;
+	}
+	if (budget_.max_nanoseconds)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - block_start_.tv_sec) * 1000000000 + (now.tv_nsec - block_start_.tv_nsec);
+		if (elapsed >= budget_.max_nanoseconds)
+		{
+			ssdpcm_search_block_stats.out_of_budget = 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* ------------------------------------------------------------------------- */
+// ssdpcm_search_report_metric: Tells the budget the error metric of the best slopes
+// found so far by the search of the calling thread's current block. The searches call
+// this whenever they find better slopes, so that they can stop once the block's target
+// error is met.
+void
+ssdpcm_search_report_metric (uint64_t metric)
+{
+	if (block_has_target_ && metric <= block_target_)
+	{
+		ssdpcm_search_block_stats.target_reached = 1;
+	}
+}
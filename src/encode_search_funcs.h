@@ -0,0 +1,374 @@
+/*
+ * ssdpcm: implementation of the SSDPCM audio codec designed by Algorithm.
+ * Copyright (C) 2022-2025 Kagamiin~
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ENCODE_SEARCH_FUNCS_H__
+#define __ENCODE_SEARCH_FUNCS_H__
+
+#include <stdint.h>
+#include <types.h>
+#include <encode.h>
+#include <errors.h>
+#include <string.h>
+
+// Building blocks shared by the slope search strategies that encode candidate slopes in
+// batches: the memo cache, the candidate queue and the one-dimensional section search.
+
+
+// Memo cache of the error metrics of the candidates already encoded for a block, since the
+// ranges of each refinement level of the search overlap the previous level's.
+// Slopes are non-negative and no bigger than the biggest difference between two samples,
+// so up to 4 of them are packed into a 16-bit field each to form the key; the cache is
+// disabled for blocks where they don't fit.
+// A metric that reached the error bound it was encoded with may be a partial sum; it's
+// still good enough to discard the candidate as long as it's not below the current bound.
+typedef struct
+{
+	uint8_t half_num_deltas;
+	uint8_t size_bits;
+	size_t count;
+	uint64_t *keys;
+	uint64_t *metrics;
+	bool *exact;
+} memo_cache_;
+
+/* ------------------------------------------------------------------------- */
+static inline void
+memo_alloc_ (memo_cache_ *memo, uint8_t half_num_deltas, sample_t max_abs_delta)
+{
+	memo->half_num_deltas = half_num_deltas;
+	memo->count = 0;
+	if (half_num_deltas > 4 || max_abs_delta > UINT16_MAX)
+	{
+		memo->size_bits = 0;
+		memo->keys = NULL;
+		memo->metrics = NULL;
+		memo->exact = NULL;
+		return;
+	}
+	// The number of candidates on the first level grows with the power of the number of slopes
+	memo->size_bits = 4 + 2 * half_num_deltas;
+	memo->keys = calloc(1 << memo->size_bits, sizeof(uint64_t));
+	memo->metrics = calloc(1 << memo->size_bits, sizeof(uint64_t));
+	memo->exact = calloc(1 << memo->size_bits, sizeof(bool));
+}
+
+/* ------------------------------------------------------------------------- */
+static inline void
+memo_free_ (memo_cache_ *memo)
+{
+	if (memo->size_bits)
+	{
+		free(memo->keys);
+		free(memo->metrics);
+		free(memo->exact);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+// Returns the index of the entry holding the given packed key, or of the empty entry
+// where it should be inserted.
+static inline size_t
+memo_probe_ (memo_cache_ *memo, uint64_t key)
+{
+	size_t mask = (1 << memo->size_bits) - 1;
+	size_t index;
+	
+	index = (key * 0x9e3779b97f4a7c15u) >> (64 - memo->size_bits);
+	while (memo->keys[index] != 0 && memo->keys[index] != key)
+	{
+		index = (index + 1) & mask;
+	}
+	return index;
+}
+
+/* ------------------------------------------------------------------------- */
+// Returns the index of the entry holding the given slopes, or of the empty entry where
+// they should be inserted. The packed key is stored with 1 added to it, so that an
+// empty entry holds 0.
+static inline size_t
+memo_find_ (memo_cache_ *memo, const sample_t *slopes, uint64_t *key)
+{
+	int i;
+	
+	*key = 0;
+	for (i = 0; i < memo->half_num_deltas; i++)
+	{
+		*key = (*key << 16) | slopes[i];
+	}
+	(*key)++;
+	
+	return memo_probe_(memo, *key);
+}
+
+/* ------------------------------------------------------------------------- */
+static inline void
+memo_insert_ (memo_cache_ *memo, const sample_t *slopes, uint64_t metric, bool exact)
+{
+	size_t index;
+	uint64_t key;
+	
+	// Keep enough of the table empty for the probes to stay short
+	if (!memo->size_bits || memo->count >= (3u << memo->size_bits) / 4)
+	{
+		return;
+	}
+	index = memo_find_(memo, slopes, &key);
+	if (memo->keys[index] == 0)
+	{
+		memo->keys[index] = key;
+		memo->count++;
+	}
+	memo->metrics[index] = metric;
+	memo->exact[index] = exact;
+}
+
+/* ------------------------------------------------------------------------- */
+// Allocates dest as a copy of src, for a thread of a parallel search level to use on
+// its own.
+static inline void
+memo_copy_ (memo_cache_ *dest, const memo_cache_ *src)
+{
+	*dest = *src;
+	if (src->size_bits)
+	{
+		dest->keys = malloc(sizeof(uint64_t) << src->size_bits);
+		dest->metrics = malloc(sizeof(uint64_t) << src->size_bits);
+		dest->exact = malloc(sizeof(bool) << src->size_bits);
+		memcpy(dest->keys, src->keys, sizeof(uint64_t) << src->size_bits);
+		memcpy(dest->metrics, src->metrics, sizeof(uint64_t) << src->size_bits);
+		memcpy(dest->exact, src->exact, sizeof(bool) << src->size_bits);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+// Merges the entries of a copy made with memo_copy_() back into the cache it was copied
+// from. Every entry is a lower bound on the candidate's error metric, or the metric
+// itself if it's exact, so the one that tells the most about the candidate is kept.
+static inline void
+memo_merge_ (memo_cache_ *dest, const memo_cache_ *src)
+{
+	size_t i, index;
+	
+	for (i = 0; i < ((size_t) 1 << src->size_bits); i++)
+	{
+		if (src->keys[i] == 0)
+		{
+			continue;
+		}
+		index = memo_probe_(dest, src->keys[i]);
+		if (dest->keys[index] == 0)
+		{
+			if (dest->count >= (3u << dest->size_bits) / 4)
+			{
+				continue;
+			}
+			dest->keys[index] = src->keys[i];
+			dest->count++;
+		}
+		else if (dest->exact[index] || (!src->exact[i] && src->metrics[i] <= dest->metrics[index]))
+		{
+			continue;
+		}
+		dest->metrics[index] = src->metrics[i];
+		dest->exact[index] = src->exact[i];
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+// Encodes the pending candidates of the search in one batch, and keeps track of the
+// best one. Candidates are compared in the order they were queued in, so the result is
+// the same as encoding them one at a time.
+static inline void
+flush_candidates_ (
+	ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, ssdpcm_block_encode_batch_func encode_batch, memo_cache_ *memo, sample_t *candidates, size_t *num_candidates, sample_t *best_slopes, uint64_t *best_metric)
+{
+	uint64_t errors[SSDPCM_ENCODE_BATCH_SIZE];
+	uint64_t error_bound = *best_metric;
+	size_t i;
+	
+	if (*num_candidates == 0)
+	{
+		return;
+	}
+	encode_batch(dest, in, sigma, candidates, *num_candidates, error_bound, errors);
+	for (i = 0; i < *num_candidates; i++)
+	{
+		memo_insert_(memo, &candidates[i * dest->num_deltas], errors[i], errors[i] < error_bound);
+		if (errors[i] < *best_metric)
+		{
+			*best_metric = errors[i];
+			memcpy(best_slopes, &candidates[i * dest->num_deltas], dest->num_deltas * sizeof(sample_t));
+		}
+	}
+	*num_candidates = 0;
+	ssdpcm_search_report_metric(*best_metric);
+}
+
+/* ------------------------------------------------------------------------- */
+// Queues the block's current slopes as a candidate of the search, unless its error
+// metric can be taken from the memo cache. The queue is flushed once it's full.
+static inline void
+queue_candidate_ (
+	ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, ssdpcm_block_encode_batch_func encode_batch, memo_cache_ *memo, ssdpcm_search_stats *stats, sample_t *candidates, size_t *num_candidates, sample_t *best_slopes, uint64_t *best_metric)
+{
+	size_t index = 0;
+	uint64_t key;
+	
+	stats->candidates++;
+	if (memo->size_bits)
+	{
+		index = memo_find_(memo, dest->slopes, &key);
+	}
+	if (memo->size_bits && memo->keys[index] != 0 && (memo->exact[index] || memo->metrics[index] >= *best_metric))
+	{
+		stats->memo_hits++;
+		if (memo->metrics[index] < *best_metric)
+		{
+			// The candidates queued before this one must be compared first
+			flush_candidates_(dest, in, sigma, encode_batch, memo, candidates, num_candidates, best_slopes, best_metric);
+			if (memo->metrics[index] < *best_metric)
+			{
+				*best_metric = memo->metrics[index];
+				memcpy(best_slopes, dest->slopes, dest->num_deltas * sizeof(sample_t));
+				ssdpcm_search_report_metric(*best_metric);
+			}
+		}
+	}
+	else
+	{
+		memcpy(&candidates[*num_candidates * dest->num_deltas], dest->slopes, dest->num_deltas * sizeof(sample_t));
+		(*num_candidates)++;
+		if (*num_candidates == SSDPCM_ENCODE_BATCH_SIZE)
+		{
+			flush_candidates_(dest, in, sigma, encode_batch, memo, candidates, num_candidates, best_slopes, best_metric);
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+// Searches the slopes of a single positive slope from low to high inclusive, one at a
+// time, with the other slopes held at their best values.
+static inline void
+search_slope_range_ (
+	ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, ssdpcm_block_encode_batch_func encode_batch, memo_cache_ *memo, ssdpcm_search_stats *stats, sample_t *candidates, sample_t *best_slopes, uint64_t *best_metric, uint8_t slope_index, sample_t low, sample_t high)
+{
+	uint8_t half_num_deltas = dest->num_deltas / 2;
+	size_t num_candidates = 0;
+	
+	for (; low <= high && !ssdpcm_search_should_stop(); low++)
+	{
+		dest->slopes[slope_index] = low;
+		dest->slopes[slope_index + half_num_deltas] = -low;
+		queue_candidate_(dest, in, sigma, encode_batch, memo, stats, candidates, &num_candidates, best_slopes, best_metric);
+	}
+	flush_candidates_(dest, in, sigma, encode_batch, memo, candidates, &num_candidates, best_slopes, best_metric);
+}
+
+/* ------------------------------------------------------------------------- */
+// One-dimensional search over a single positive slope, between low and high inclusive,
+// with the other slopes held at their best values. The error metric is a function of
+// one variable, so instead of a grid, each step evaluates a whole batch of slopes evenly
+// spread over the current range and narrows the range down to the neighbors of the best
+// slope, until the range fits in a batch and can be searched exhaustively. The best
+// slope may be one found before the step, so the range is narrowed around its value,
+// not around the best point of the step. Since the metric isn't strictly unimodal, a
+// last exhaustive pass covers a batch's worth of slopes on each side of the best one.
+// The block's slopes must be the best slopes found so far, and are left that way.
+static inline void
+do_section_search_ (
+	ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, ssdpcm_block_encode_batch_func encode_batch, memo_cache_ *memo, ssdpcm_search_stats *stats, sample_t *candidates, sample_t *best_slopes, uint64_t *best_metric, uint8_t slope_index, sample_t low, sample_t high)
+{
+	uint8_t half_num_deltas = dest->num_deltas / 2;
+	size_t num_candidates = 0;
+	sample_t range_low = low;
+	sample_t range_high = high;
+	sample_t best;
+	
+	while (high - low + 1 > SSDPCM_ENCODE_BATCH_SIZE && !ssdpcm_search_should_stop())
+	{
+		sample_t points[SSDPCM_ENCODE_BATCH_SIZE];
+		int i;
+		
+		for (i = 0; i < SSDPCM_ENCODE_BATCH_SIZE; i++)
+		{
+			points[i] = low + (high - low) * i / (SSDPCM_ENCODE_BATCH_SIZE - 1);
+			dest->slopes[slope_index] = points[i];
+			dest->slopes[slope_index + half_num_deltas] = -points[i];
+			queue_candidate_(dest, in, sigma, encode_batch, memo, stats, candidates, &num_candidates, best_slopes, best_metric);
+		}
+		flush_candidates_(dest, in, sigma, encode_batch, memo, candidates, &num_candidates, best_slopes, best_metric);
+		
+		// Find the first point at or past the best slope
+		best = best_slopes[slope_index];
+		for (i = 0; i < SSDPCM_ENCODE_BATCH_SIZE - 1 && points[i] < best; i++)
+		{
+		}
+		if (points[i] == best)
+		{
+			low = i > 0 ? points[i - 1] + 1 : low;
+			high = i < SSDPCM_ENCODE_BATCH_SIZE - 1 ? points[i + 1] - 1 : high;
+		}
+		else if (best < low || best > high)
+		{
+			// Only possible if the best slopes were outside the range to begin with
+			high = low - 1;
+		}
+		else
+		{
+			// The best slope is between two points, none of which beat it
+			low = points[i - 1] + 1;
+			high = points[i] - 1;
+		}
+	}
+	
+	search_slope_range_(dest, in, sigma, encode_batch, memo, stats, candidates, best_slopes, best_metric, slope_index, low, high);
+	
+	best = best_slopes[slope_index];
+	low = best - SSDPCM_ENCODE_BATCH_SIZE < range_low ? range_low : best - SSDPCM_ENCODE_BATCH_SIZE;
+	high = best + SSDPCM_ENCODE_BATCH_SIZE > range_high ? range_high : best + SSDPCM_ENCODE_BATCH_SIZE;
+	search_slope_range_(dest, in, sigma, encode_batch, memo, stats, candidates, best_slopes, best_metric, slope_index, low, high);
+	
+	memcpy(dest->slopes, best_slopes, dest->num_deltas * sizeof(sample_t));
+}
+
+/* ------------------------------------------------------------------------- */
+// Finds the biggest difference between two successive samples, which bounds the slopes
+// worth trying.
+static inline sample_t
+find_max_abs_delta_ (ssdpcm_block *dest, sample_t *in)
+{
+	sample_t max_abs_delta = 0;
+	sample_t delta;
+	size_t i;
+	
+	for (i = 1; i < dest->length; i++)
+	{
+		delta = in[i] - in[i - 1];
+		if (delta < 0)
+		{
+			delta = -delta;
+		}
+		if (delta > max_abs_delta)
+		{
+			max_abs_delta = delta;
+		}
+	}
+	return max_abs_delta;
+}
+
+#endif // __ENCODE_SEARCH_FUNCS_H__
@@ -17,6 +17,7 @@
  */
 
 #include "types.h"
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,6 +29,12 @@
 #include <bit_pack_unpack.h>
 #include <range_coder.h>
 #include <wav.h>
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#define omp_get_max_threads() 1
+#define omp_get_thread_num() 0
+#endif
 
 void
 exit_error (const char *msg, const char *error)
@@ -50,8 +57,25 @@ write_block_params (FILE *dest, uint8_t initial_sample, uint8_t length)
 	fprintf(dest, "length := %hhu\n", length);
 }
 
+// A block read ahead by the pipelined encoder, and what its speculative search found.
+typedef struct
+{
+	uint8_t initial_sample_temp[4];
+	sample_t *samples[2];
+	sample_t slopes[2][16];
+	ssdpcm_block block[2];
+	uint64_t metric[2];
+	// Whether the block's initial sample was guessed, rather than known
+	bool guessed;
+} pipeline_slot;
+
+// Usage text, up to the list of search strategies.
 static const char usage[] = "\
-\033[97mUsage:\033[0m encoder (mode) infile.wav outfile.aud [-d|--dither [strength]]\n\
+\033[97mUsage:\033[0m encoder (mode) infile.wav outfile.aud [-d|--dither [strength]] [-w|--warm-start]\n\
+       [-s|--search strategy] [--max-candidates-per-block count]\n\
+       [--deadline-ms-per-block milliseconds] [--target-sse error]\n\
+       [--target-snr dB] [--block-cache [entries]] [--cache-dir directory]\n\
+       [-p|--pipeline [depth]]\n\
 - Parameters\n\
   - \033[96mmode\033[0m - Selects the encoding mode; the following modes are\n\
     supported (in increasing order of bitrate):\n\
@@ -74,10 +98,64 @@ static const char usage[] = "\
   strong.\n\
   \033[96mNOTE:\033[0m dithering is currently not working right and it's not advised to\n\
   use it.\n\
+- \033[96m-w\033[0m/\033[96m--warm-start\033[0m starts the slope search of each block from the previous\n\
+  block's slopes, searching only around them unless they turn out to be a poor\n\
+  fit. Much faster on tonal material, at a small cost in quality.\n\
+  Same as \033[96m--search binary-warm\033[0m.\n\
+- \033[96m-s\033[0m/\033[96m--search\033[0m selects how the slopes of each block are searched for:\n\
 ";
 
+// Rest of the usage text, after the list of search strategies.
+static const char usage_tail[] = "\
+  The number of slope sets tried and the time taken per block are printed at\n\
+  the end, to compare the strategies.\n\
+- \033[96m--max-candidates-per-block\033[0m and \033[96m--deadline-ms-per-block\033[0m limit the\n\
+  search of each block to a number of slope sets or to a wall time (which can\n\
+  be fractional). When the limit is hit, the block is encoded with the best\n\
+  slopes found so far. The number of blocks that hit it is printed at the end.\n\
+  With a deadline, the output depends on the speed of the machine.\n\
+- \033[96m--target-sse\033[0m and \033[96m--target-snr\033[0m stop the search of a block as soon as\n\
+  its error is good enough: a sum of squared errors, or a signal-to-noise ratio\n\
+  in dB relative to the block's own energy. Quiet, easy blocks then take a\n\
+  fraction of the search, while hard ones still get all of it.\n\
+- \033[96m--block-cache\033[0m reuses the encoding of earlier blocks with exactly the same\n\
+  input, as found in loops and repeated sounds, instead of searching again.\n\
+  This takes an optional argument with the maximum number of blocks kept\n\
+  (16384 by default, about 1 KiB each).\n\
+- \033[96m--cache-dir\033[0m keeps a copy of every encoded file in the given directory,\n\
+  named after a hash of the input file, the mode, the search settings and the\n\
+  encoder version. Encoding the same input with the same settings again just\n\
+  copies the cached file, which is identical to encoding it from scratch.\n\
+- \033[96m-p\033[0m/\033[96m--pipeline\033[0m searches several blocks ahead at once on all threads,\n\
+  guessing that each block starts at the last input sample of the one before.\n\
+  Once the real decoded sample is known, a block with a wrong guess gets its\n\
+  slopes refined, or is searched again if they turn out to be a poor fit.\n\
+  Unlike \033[96mencoder_parallel\033[0m, the output has no reference samples, but it\n\
+  can be slightly different from a normal encode. This takes an optional\n\
+  argument with the number of blocks searched at once (8 by default). The\n\
+  output only depends on this number, not on the number of threads, which is\n\
+  set with OMP_NUM_THREADS. Can't be used with \033[96mbinary-warm\033[0m.\n\
+";
+
+/* ------------------------------------------------------------------------- */
+// Prints the usage text, with the list of search strategies, and exits.
+static void
+exit_usage (void)
+{
+	fprintf(stderr, "\nOof!\n%s", usage);
+	ssdpcm_search_print_strategies(true);
+	fprintf(stderr, "%s\n", usage_tail);
+	exit(1);
+}
+
 #define SAMPLES_PER_BLOCK 128
 
+#define BLOCK_CACHE_DEFAULT_ENTRIES 16384
+
+// Blocks searched at once by --pipeline without a depth. The depth decides which initial
+// samples are guessed, and so the output, so it doesn't follow the number of threads.
+#define PIPELINE_DEFAULT_DEPTH 8
+
 int
 main (int argc, char **argv)
 {
@@ -98,11 +176,11 @@ main (int argc, char **argv)
 	bool stereo = false;
 	bool comb_filter = false;
 	bool decode_mode = false;
-	bool has_reference_sample_on_every_block = false;
 	
 	void *code_buffer[2];
 	void *sample_conv_buffer = NULL;
 	bitstream_buffer bitpacker;
+	ssdpcm_block_decode_packed_func decode_packed = NULL;
 	sample_t *sample_buffer[2];
 	sample_t *dither_buffer[2];
 	codeword_t *delta_buffer[2];
@@ -114,15 +192,25 @@ main (int argc, char **argv)
 	
 	bool dither = false;
 	uint8_t dither_strength = 0;
+	ssdpcm_search_methods search = ssdpcm_search_binary_search;
+	ssdpcm_search_budget budget = {0};
+	const char *cache_dir = NULL;
+	ssdpcm_file_cache_key cache_key;
+	size_t pipeline_depth = 0;
+	size_t pipeline_filled = 0;
+	size_t pipeline_next = 0;
+	bool pipeline_at_end = false;
+	pipeline_slot *pipeline = NULL;
+	sigma_tracker *pipeline_sigma = NULL;
 	
 	memset(slopes[0], 0, sizeof(sample_t) * 16);
 	memset(slopes[1], 0, sizeof(sample_t) * 16);
 	
-	if (argc < 4 || argc > 6)
+	if (argc < 4)
 	{
-		exit_error(usage, NULL);
+		exit_usage();
 	}
-
+	
 	if (!strcmp("ss1", argv[1]))
 	{
 		mode = SS_SS1;
@@ -167,31 +255,126 @@ main (int argc, char **argv)
 	else
 	{
 		num_deltas = 0;
-		exit_error(usage, NULL);
+		exit_usage();
 	}
 	
-	if (argc > 4)
+	for (i = 4; i < argc; i++)
 	{
-		bool is_dither_arg = !strcmp("-d", argv[4]) || !strcmp("--dither", argv[4]);
-		if (is_dither_arg)
+		if (!strcmp("-d", argv[i]) || !strcmp("--dither", argv[i]))
 		{
 			dither = true;
+			if (i + 1 < argc && argv[i + 1][0] != '-')
+			{
+				int result = sscanf(argv[++i], "%hhu", &dither_strength);
+				if (result != 1)
+				{
+					fprintf(stderr, "Invalid dither strength '%s'.\n", argv[i]);
+					exit_usage();
+				}
+			}
 		}
-		else
+		else if (!strcmp("-w", argv[i]) || !strcmp("--warm-start", argv[i]))
 		{
-			fprintf(stderr, "Invalid dither argument '%s'.\n", argv[4]);
-			exit_error(usage, NULL);
+			search = ssdpcm_search_binary_search_warm;
+		}
+		else if (!strcmp("-s", argv[i]) || !strcmp("--search", argv[i]))
+		{
+			if (i + 1 >= argc)
+			{
+				exit_usage();
+			}
+			search = ssdpcm_search_find(argv[++i]);
+			if (search == NULL)
+			{
+				fprintf(stderr, "Unknown search strategy '%s'.\n", argv[i]);
+				exit_usage();
+			}
 		}
-		if (argc > 5) {
-			int result = sscanf(argv[5], "%hhu", &dither_strength);
-			if (result != 1)
+		else if (!strcmp("--max-candidates-per-block", argv[i]))
+		{
+			if (i + 1 >= argc || sscanf(argv[++i], "%" SCNu64, &budget.max_candidates) != 1 || budget.max_candidates == 0)
 			{
-				fprintf(stderr, "Invalid dither strength '%s'.\n", argv[5]);
-				exit_error(usage, NULL);
+				fprintf(stderr, "Invalid number of candidates per block.\n");
+				exit_usage();
 			}
 		}
+		else if (!strcmp("--deadline-ms-per-block", argv[i]))
+		{
+			double deadline_ms;
+			if (i + 1 >= argc || sscanf(argv[++i], "%lf", &deadline_ms) != 1 || !(deadline_ms > 0))
+			{
+				fprintf(stderr, "Invalid deadline per block.\n");
+				exit_usage();
+			}
+			budget.max_nanoseconds = deadline_ms * 1e6 < 1 ? 1 : deadline_ms * 1e6;
+		}
+		else if (!strcmp("--block-cache", argv[i]))
+		{
+			size_t cache_entries = BLOCK_CACHE_DEFAULT_ENTRIES;
+			if (i + 1 < argc && argv[i + 1][0] != '-')
+			{
+				if (sscanf(argv[++i], "%zu", &cache_entries) != 1 || cache_entries == 0)
+				{
+					fprintf(stderr, "Invalid block cache size '%s'.\n", argv[i]);
+					exit_usage();
+				}
+			}
+			if (!ssdpcm_block_cache_enabled())
+			{
+				ssdpcm_block_cache_init(cache_entries);
+			}
+		}
+		else if (!strcmp("-p", argv[i]) || !strcmp("--pipeline", argv[i]))
+		{
+			pipeline_depth = PIPELINE_DEFAULT_DEPTH;
+			if (i + 1 < argc && argv[i + 1][0] != '-')
+			{
+				if (sscanf(argv[++i], "%zu", &pipeline_depth) != 1 || pipeline_depth == 0)
+				{
+					fprintf(stderr, "Invalid pipeline depth '%s'.\n", argv[i]);
+					exit_usage();
+				}
+			}
+		}
+		else if (!strcmp("--cache-dir", argv[i]))
+		{
+			if (i + 1 >= argc)
+			{
+				exit_usage();
+			}
+			cache_dir = argv[++i];
+		}
+		else if (!strcmp("--target-sse", argv[i]))
+		{
+			if (i + 1 >= argc || sscanf(argv[++i], "%" SCNu64, &budget.target_error) != 1 || budget.target_error == 0)
+			{
+				fprintf(stderr, "Invalid target error.\n");
+				exit_usage();
+			}
+		}
+		else if (!strcmp("--target-snr", argv[i]))
+		{
+			if (i + 1 >= argc || sscanf(argv[++i], "%lf", &budget.target_snr_db) != 1 || budget.target_snr_db == 0)
+			{
+				fprintf(stderr, "Invalid target SNR.\n");
+				exit_usage();
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Invalid argument '%s'.\n", argv[i]);
+			exit_usage();
+		}
 	}
 	
+	if (pipeline_depth && search->sequential)
+	{
+		fprintf(stderr, "Search strategy '%s' can't be used with --pipeline.\n", search->name);
+		exit_usage();
+	}
+	
+	ssdpcm_search_set_budget(&budget);
+	
 	infile_name = argv[2];
 	outfile_name = argv[3];
 	
@@ -230,6 +413,11 @@ main (int argc, char **argv)
 			exit_error("Input file has more than 2 channels - only mono or stereo is supported", NULL);
 		}
 		comb_filter = (mode == SS_SS1C);
+		decode_packed = ssdpcm_block_decode_packed_select(mode, format);
+		if (decode_packed == NULL)
+		{
+			exit_error("Input file has an unsupported SSDPCM mode or sample format", NULL);
+		}
 		code_buffer_size = wav_get_ssdpcm_code_bytes_per_block(infile, &err);
 		for (i = 0; i <= stereo; i++)
 		{
@@ -291,6 +479,31 @@ main (int argc, char **argv)
 		exit_error("Input file and output file cannot be the same file!", NULL);
 	}
 	
+	if (cache_dir != NULL && !decode_mode)
+	{
+		ssdpcm_file_cache_key_init(&cache_key, "encoder");
+		ssdpcm_file_cache_key_add(&cache_key, argv[1], strlen(argv[1]) + 1);
+		ssdpcm_file_cache_key_add(&cache_key, &block_length, sizeof(block_length));
+		ssdpcm_file_cache_key_add(&cache_key, search->name, strlen(search->name) + 1);
+		ssdpcm_file_cache_key_add(&cache_key, &budget.max_candidates, sizeof(budget.max_candidates));
+		ssdpcm_file_cache_key_add(&cache_key, &budget.max_nanoseconds, sizeof(budget.max_nanoseconds));
+		ssdpcm_file_cache_key_add(&cache_key, &budget.target_error, sizeof(budget.target_error));
+		ssdpcm_file_cache_key_add(&cache_key, &budget.target_snr_db, sizeof(budget.target_snr_db));
+		ssdpcm_file_cache_key_add(&cache_key, &dither, sizeof(dither));
+		ssdpcm_file_cache_key_add(&cache_key, &dither_strength, sizeof(dither_strength));
+		ssdpcm_file_cache_key_add(&cache_key, &pipeline_depth, sizeof(pipeline_depth));
+		if (!ssdpcm_file_cache_key_add_file(&cache_key, infile_name))
+		{
+			exit_error("Could not read input file. errno", strerror(errno));
+		}
+		if (ssdpcm_file_cache_fetch(cache_dir, &cache_key, infile_name, outfile_name))
+		{
+			wav_close(infile, &err);
+			fprintf(stderr, "Reused the cached encoding from '%s'.\nDone.\n", cache_dir);
+			return 0;
+		}
+	}
+	
 	outfile = wav_open(outfile, outfile_name, W_CREATE, &err);
 	if (outfile == NULL)
 	{
@@ -306,11 +519,10 @@ main (int argc, char **argv)
 	{
 		wav_set_format(outfile, format);
 		sample_conv_buffer = malloc(wav_get_sizeof(outfile, block_length));
-		has_reference_sample_on_every_block = wav_ssdpcm_has_reference_sample_on_every_block(infile, &err);
 	}
 	else
 	{
-		wav_init_ssdpcm(outfile, format, mode, block_length, false);
+		wav_init_ssdpcm(outfile, format, mode, block_length, 0);
 		code_buffer_size = wav_get_ssdpcm_code_bytes_per_block(outfile, &err);
 		for (i = 0; i <= stereo; i++)
 		{
@@ -319,6 +531,28 @@ main (int argc, char **argv)
 			dither_buffer[i] = malloc(sizeof(sample_t) * block_length);
 			delta_buffer[i] = malloc(sizeof(codeword_t) * block_length);
 		}
+		if (pipeline_depth)
+		{
+			size_t k;
+			pipeline = calloc(pipeline_depth, sizeof(pipeline_slot));
+			for (k = 0; k < pipeline_depth; k++)
+			{
+				for (i = 0; i <= stereo; i++)
+				{
+					pipeline[k].samples[i] = malloc(sizeof(sample_t) * block_length);
+					pipeline[k].block[i].num_deltas = num_deltas;
+					pipeline[k].block[i].deltas = malloc(sizeof(codeword_t) * block_length);
+					pipeline[k].block[i].slopes = pipeline[k].slopes[i];
+					pipeline[k].block[i].length = block_length;
+				}
+			}
+			pipeline_sigma = malloc(sizeof(sigma_tracker) * omp_get_max_threads());
+			for (i = 0; i < omp_get_max_threads(); i++)
+			{
+				pipeline_sigma[i].methods = sigma.methods;
+				pipeline_sigma[i].methods->alloc(&pipeline_sigma[i].state);
+			}
+		}
 	}
 	
 	for (i = 0; i <= stereo; i++)
@@ -395,48 +629,121 @@ main (int argc, char **argv)
 			break;
 		}
 	}
-
+	
 	while (err == E_OK)
 	{
 		uint8_t initial_sample_temp[4];
 		int c;
 		if (!decode_mode)
 		{
-			switch (format)
+			pipeline_slot *slot = NULL;
+			
+			if (pipeline_next == pipeline_filled)
 			{
-			case W_U8:
-				if (dither)
+				// Convert the block just read; when pipelined, keep reading blocks ahead until
+				// the pipeline is full, then search all of them at once
+				pipeline_next = 0;
+				pipeline_filled = 0;
+				for (;;)
 				{
-					sample_decode_u8_multichannel(dither_buffer, (uint8_t *)sample_conv_buffer, block_length, stereo + 1);
-					sample_dither_triangular(sample_buffer, dither_buffer, block_length, stereo + 1, dither_strength, 0, UINT8_MAX);
-				}
-				else
-				{
-					sample_decode_u8_multichannel(sample_buffer, (uint8_t *)sample_conv_buffer, block_length, stereo + 1);
+					sample_t **input = pipeline_depth ? pipeline[pipeline_filled].samples : sample_buffer;
+					switch (format)
+					{
+					case W_U8:
+						if (dither)
+						{
+							sample_decode_u8_multichannel(dither_buffer, (uint8_t *)sample_conv_buffer, block_length, stereo + 1);
+							sample_dither_triangular(input, dither_buffer, block_length, stereo + 1, dither_strength, 0, UINT8_MAX);
+						}
+						else
+						{
+							sample_decode_u8_multichannel(input, (uint8_t *)sample_conv_buffer, block_length, stereo + 1);
+						}
+						break;
+					case W_S16LE:
+						if (dither)
+						{
+							sample_decode_s16_multichannel(dither_buffer, (int16_t *)sample_conv_buffer, block_length, stereo + 1);
+							sample_dither_triangular(input, dither_buffer, block_length, stereo + 1, dither_strength, INT16_MIN, INT16_MAX);
+						}
+						else
+						{
+							sample_decode_s16_multichannel(input, (int16_t *)sample_conv_buffer, block_length, stereo + 1);
+						}
+						break;
+					default:
+						// unreachable
+						break;
+					}
+					
+					if (!pipeline_depth)
+					{
+						memcpy(initial_sample_temp, sample_conv_buffer, sizeof(initial_sample_temp));
+						break;
+					}
+					memcpy(pipeline[pipeline_filled].initial_sample_temp, sample_conv_buffer, sizeof(initial_sample_temp));
+					pipeline[pipeline_filled].guessed = pipeline_filled > 0;
+					if (++pipeline_filled == pipeline_depth)
+					{
+						break;
+					}
+					
+					(void) wav_read(infile, sample_conv_buffer, block_length, &err);
+					if (err != E_OK)
+					{
+						if (err == E_END_OF_STREAM)
+						{
+							pipeline_at_end = true;
+							err = E_OK;
+							break;
+						}
+						char err_msg[256];
+						int errno_copy = errno;
+						snprintf(err_msg, 256, "Read error (%s)", error_enum_strs[err]);
+						// Try to properly close the WAV file anyway
+						wav_close(outfile, &err);
+						exit_error(err_msg, strerror(errno_copy));
+					}
 				}
-				break;
-			case W_S16LE:
-				if (dither)
+				
+				if (pipeline_depth)
 				{
-					sample_decode_s16_multichannel(dither_buffer, (int16_t *)sample_conv_buffer, block_length, stereo + 1);
-					sample_dither_triangular(sample_buffer, dither_buffer, block_length, stereo + 1, dither_strength, INT16_MIN, INT16_MAX);
+					// Only the first block's initial sample is known; the others are guessed
+					// from the last input sample of the block before them
+					int j;
+#pragma omp parallel for schedule(dynamic)
+					for (j = 0; j < (int)pipeline_filled * (stereo + 1); j++)
+					{
+						int k = j / (stereo + 1);
+						int ch = j % (stereo + 1);
+						sigma_tracker *thread_sigma = &pipeline_sigma[omp_get_thread_num()];
+						pipeline[k].block[ch].initial_sample = k == 0 ? block[ch].initial_sample : pipeline[k - 1].samples[ch][block_length - 1];
+						pipeline[k].metric[ch] = ssdpcm_search_encode(search, &pipeline[k].block[ch], pipeline[k].samples[ch], thread_sigma);
+					}
 				}
-				else
+			}
+			
+			if (pipeline_depth)
+			{
+				slot = &pipeline[pipeline_next++];
+				memcpy(initial_sample_temp, slot->initial_sample_temp, sizeof(initial_sample_temp));
+				for (c = 0; c <= stereo; c++)
 				{
-					sample_decode_s16_multichannel(sample_buffer, (int16_t *)sample_conv_buffer, block_length, stereo + 1);
+					memcpy(sample_buffer[c], slot->samples[c], sizeof(sample_t) * block_length);
 				}
-				break;
-			default:
-				// unreachable
-				break;
 			}
 			
-			memcpy(initial_sample_temp, sample_conv_buffer, sizeof(initial_sample_temp));
-			
 			fprintf(stderr, "\rEncoding block %lu...", block_count);
 			for (c = 0; c <= stereo; c++)
 			{
-				(void) ssdpcm_encode_binary_search(&block[c], sample_buffer[c], &sigma);
+				if (slot != NULL)
+				{
+					(void) ssdpcm_search_encode_speculated(search, &block[c], sample_buffer[c], &sigma, &slot->block[c], slot->metric[c], slot->guessed);
+				}
+				else
+				{
+					(void) ssdpcm_search_encode(search, &block[c], sample_buffer[c], &sigma);
+				}
 				ssdpcm_block_decode(sample_buffer[c], &block[c]);
 				temp_last_sample[c] = sample_buffer[c][block_length - 1];
 				if (comb_filter)
@@ -507,7 +814,7 @@ main (int argc, char **argv)
 					// unreachable
 					break;
 				}
-
+				
 				err = wav_write_ssdpcm_block(outfile, initial_sample_temp, sample_conv_buffer, code_buffer[c], -1, c);
 				if (err != E_OK)
 				{
@@ -522,68 +829,36 @@ main (int argc, char **argv)
 				block[c].initial_sample = temp_last_sample[c];
 			}
 			
-			(void) wav_read(infile, sample_conv_buffer, block_length, &err);
-			if (err != E_OK)
+			if (pipeline_next == pipeline_filled)
 			{
-				if (err == E_END_OF_STREAM)
+				if (pipeline_at_end)
 				{
 					goto finish;
 				}
-				char err_msg[256];
-				int errno_copy = errno;
-				snprintf(err_msg, 256, "Read error (%s)", error_enum_strs[err]);
-				// Try to properly close the WAV file anyway
-				wav_close(outfile, &err);
-				exit_error(err_msg, strerror(errno_copy));
+				(void) wav_read(infile, sample_conv_buffer, block_length, &err);
+				if (err != E_OK)
+				{
+					if (err == E_END_OF_STREAM)
+					{
+						goto finish;
+					}
+					char err_msg[256];
+					int errno_copy = errno;
+					snprintf(err_msg, 256, "Read error (%s)", error_enum_strs[err]);
+					// Try to properly close the WAV file anyway
+					wav_close(outfile, &err);
+					exit_error(err_msg, strerror(errno_copy));
+				}
 			}
 		}
 		
 		if (decode_mode)
 		{
-
+			
 			int c;
 			for (c = 0; c <= stereo; c++)
 			{
-				bitpacker.byte_buf.buffer = code_buffer[c];
-				bitpacker.byte_buf.offset = 0;
-				bitpacker.bit_index = 0;
-				switch (mode)
-				{
-				case SS_SS1:
-				case SS_SS1C:
-					for (i = 0; i < block_length; i++)
-					{
-						err = get_bits_msbfirst(&block[c].deltas[i], &bitpacker, 1);
-						if (err != E_OK)
-						{
-							exit_error("Runtime error: get_bits_msbfirst returned non-ok status", error_enum_strs[err]);
-						}
-					}
-					break;
-				case SS_SS2:
-					for (i = 0; i < block_length; i++)
-					{
-						err = get_bits_msbfirst(&block[c].deltas[i], &bitpacker, 2);
-						if (err != E_OK)
-						{
-							exit_error("Runtime error: get_bits_msbfirst returned non-ok status", error_enum_strs[err]);
-						}
-					}
-					break;
-				case SS_SS1_6:
-					range_decode_ss1_6((uint8_t *)code_buffer[c], block[c].deltas, code_buffer_size);
-					break;
-				case SS_SS2_3:
-					range_decode_ss2_3((uint8_t *)code_buffer[c], block[c].deltas, code_buffer_size);
-					break;
-				case SS_SS3:
-					range_decode_ss3((uint8_t *)code_buffer[c], block[c].deltas, code_buffer_size);
-					break;
-				default:
-					// unreachable
-					debug_assert(0 && "unexpected SSDPCM mode");
-					break;
-				}
+				void *out = (format == W_U8) ? (void *)((uint8_t *)sample_conv_buffer + c) : (void *)((int16_t *)sample_conv_buffer + c);
 				
 				for (i = 0; i < block[c].num_deltas / 2; i++)
 				{
@@ -591,28 +866,11 @@ main (int argc, char **argv)
 				}
 				
 				fprintf(stderr, "\rDecoding block %lu...", block_count);
-				ssdpcm_block_decode(sample_buffer[c], &block[c]);
-				temp_last_sample[c] = sample_buffer[c][block_length - 1];
-				if (comb_filter)
-				{
-					sample_filter_comb(sample_buffer[c], block_length, block[c].initial_sample);
-				}
+				// Blocks are decoded straight from their code into the output samples
+				temp_last_sample[c] = decode_packed(out, stereo + 1, code_buffer[c], code_buffer_size, &block[c]);
 				block[c].initial_sample = temp_last_sample[c];
 			}
 			
-			switch (format)
-			{
-			case W_U8:
-				sample_encode_u8_overflow_multichannel((uint8_t *)sample_conv_buffer, sample_buffer, block_length, stereo + 1);
-				break;
-			case W_S16LE:
-				sample_encode_s16_multichannel((int16_t *)sample_conv_buffer, sample_buffer, block_length, stereo + 1);
-				break;
-			default:
-				// unreachable
-				break;
-			}
-			
 			wav_write(outfile, sample_conv_buffer, block_length, -1, &err);
 			if (err != E_OK)
 			{
@@ -644,7 +902,7 @@ main (int argc, char **argv)
 				{
 				case W_U8:
 					sample_decode_u8(block[c].slopes, sample_conv_buffer, block[c].num_deltas / 2);
-					if (c == 0 && has_reference_sample_on_every_block)
+					if (c == 0 && wav_ssdpcm_frame_has_reference(infile, block_count + 1))
 					{
 						sample_decode_u8(&block[0].initial_sample, initial_sample_temp, 1);
 						sample_decode_u8(&block[1].initial_sample, initial_sample_temp + 1, 1);
@@ -652,7 +910,7 @@ main (int argc, char **argv)
 					break;
 				case W_S16LE:
 					sample_decode_u16(block[c].slopes, sample_conv_buffer, block[c].num_deltas / 2);
-					if (c == 0 && has_reference_sample_on_every_block)
+					if (c == 0 && wav_ssdpcm_frame_has_reference(infile, block_count + 1))
 					{
 						sample_decode_s16(&block[0].initial_sample, ((int16_t *)initial_sample_temp), 1);
 						sample_decode_s16(&block[1].initial_sample, ((int16_t *)initial_sample_temp) + 1, 1);
@@ -672,7 +930,46 @@ finish:
 	wav_close(infile, &err);
 	wav_close(outfile, &err);
 	
+	if (cache_dir != NULL && !decode_mode)
+	{
+		if (!ssdpcm_file_cache_store(cache_dir, &cache_key, infile_name, outfile_name))
+		{
+			fprintf(stderr, "\nCould not store the encoded file in the cache directory '%s': %s", cache_dir, strerror(errno));
+		}
+	}
+	
+	if (!decode_mode)
+	{
+		ssdpcm_search_stats stats;
+		ssdpcm_search_get_stats(search, &stats);
+		if (stats.blocks)
+		{
+			fprintf(stderr, "\nSearch '%s': %.1f slope sets and %.3f ms per block.", search->name, (double)stats.candidates / stats.blocks, stats.nanoseconds / 1e6 / stats.blocks);
+			fprintf(stderr, "\nSearched %" PRIu64 " slope sets, %" PRIu64 " of them (%.1f%%) found in the memo cache.", stats.candidates, stats.memo_hits, stats.candidates ? 100.0 * stats.memo_hits / stats.candidates : 0.0);
+			if (budget.max_candidates || budget.max_nanoseconds)
+			{
+				fprintf(stderr, "\n%" PRIu64 " of %" PRIu64 " blocks (%.1f%%) ran out of search budget.", stats.out_of_budget, stats.blocks, 100.0 * stats.out_of_budget / stats.blocks);
+			}
+			if (ssdpcm_block_cache_enabled())
+			{
+				fprintf(stderr, "\n%" PRIu64 " of %" PRIu64 " blocks (%.1f%%) reused from the block cache.", stats.cache_hits, stats.blocks, 100.0 * stats.cache_hits / stats.blocks);
+			}
+			if (stats.flat_blocks)
+			{
+				fprintf(stderr, "\n%" PRIu64 " of %" PRIu64 " blocks (%.1f%%) were flat and skipped the search.", stats.flat_blocks, stats.blocks, 100.0 * stats.flat_blocks / stats.blocks);
+			}
+			if (budget.target_error || budget.target_snr_db != 0)
+			{
+				fprintf(stderr, "\n%" PRIu64 " of %" PRIu64 " blocks (%.1f%%) met the target error early.", stats.target_reached, stats.blocks, 100.0 * stats.target_reached / stats.blocks);
+			}
+			if (pipeline_depth)
+			{
+				fprintf(stderr, "\n%" PRIu64 " of %" PRIu64 " guessed initial samples (%.1f%%) were right; %" PRIu64 " blocks were refined and %" PRIu64 " searched again.", stats.speculation_hits, stats.speculation_guesses, stats.speculation_guesses ? 100.0 * stats.speculation_hits / stats.speculation_guesses : 0.0, stats.speculation_refined, stats.speculation_redone);
+			}
+		}
+	}
 	fprintf(stderr, "\nDone.\n");
+	ssdpcm_block_cache_free();
 	sigma.methods->free(&(sigma.state));
 	free(infile);
 	free(outfile);
@@ -683,6 +980,24 @@ finish:
 		free(delta_buffer[i]);
 	}
 	free(sample_conv_buffer);
+	if (pipeline != NULL)
+	{
+		size_t k;
+		for (k = 0; k < pipeline_depth; k++)
+		{
+			for (i = 0; i <= stereo; i++)
+			{
+				free(pipeline[k].samples[i]);
+				free(pipeline[k].block[i].deltas);
+			}
+		}
+		for (i = 0; i < omp_get_max_threads(); i++)
+		{
+			pipeline_sigma[i].methods->free(&pipeline_sigma[i].state);
+		}
+		free(pipeline);
+		free(pipeline_sigma);
+	}
 	
 	return 0;
 }
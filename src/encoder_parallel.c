@@ -17,6 +17,7 @@
  */
 
 #include "types.h"
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +28,7 @@
 #include <bit_pack_unpack.h>
 #include <range_coder.h>
 #include <wav.h>
+#include <frame_queue.h>
 #include <omp.h>
 
 void
@@ -43,8 +45,508 @@ exit_error (const char *msg, const char *error)
 	exit(1);
 }
 
+// Number of frames the reader thread reads from the input file at once, rounded down
+// to whole groups.
+#define READ_CHUNK_FRAMES 256
+
+// Number of groups the reader thread can queue up for each encoding thread.
+#define QUEUED_GROUPS_PER_THREAD 4
+
+// A group of frames, up to the next reference sample, queued up by the reader thread
+// to be encoded. It's followed by its samples, split into one buffer per channel with
+// room for reference_interval frames each.
+typedef struct
+{
+	size_t start;
+	size_t length;
+	uint8_t reference[4];
+} frame_group;
+
+// State of the reader thread, which reads the input file a chunk at a time.
+typedef struct
+{
+	wav_handle *infile;
+	wav_sample_fmt format;
+	long block_length;
+	uint8_t reference_interval;
+	int num_channels;
+	uint8_t *chunk;
+	size_t chunk_frames;
+	size_t chunk_pos;
+	size_t next_frame;
+	bool end_of_stream;
+} frame_reader;
+
+// A frame encoded by one of the threads, waiting in the reorder buffer to be written
+// out. It's followed by the code of each channel.
+typedef struct
+{
+	uint8_t reference[4];
+	uint8_t slopes[2][16];
+} encoded_frame;
+
+// Where the frames drained from the reorder buffer are written to.
+typedef struct
+{
+	wav_handle *outfile;
+	int num_channels;
+	size_t code_size;
+} frame_writer;
+
+// Read-only state shared by the threads when decoding a file mapped to memory.
+typedef struct
+{
+	wav_handle *infile;
+	wav_handle *outfile;
+	const uint8_t *data;
+	uint8_t *output;
+	ssdpcm_block_mode mode;
+	wav_sample_fmt format;
+	long block_length;
+	int num_deltas;
+	int num_channels;
+	size_t sample_size;
+	size_t slopes_size;
+	size_t code_size;
+	ssdpcm_block_decode_packed_func decode_packed;
+} frame_decoder;
+
+/* ------------------------------------------------------------------------- */
+// Takes the next group of frames from the reader's chunk, reading another chunk from
+// the input file once it runs out. Only whole frames are encoded, so a partial frame
+// at the end of the file is dropped.
+// Returns false at the end of the file, or if there was a read error.
+static bool
+read_group (frame_reader *reader, frame_group *group, err_t *err)
+{
+	size_t frame_size = wav_get_sizeof(reader->infile, reader->block_length);
+	size_t group_capacity = reader->reference_interval * reader->block_length;
+	sample_t *samples[2];
+	uint8_t *frames;
+	int n;
+	
+	*err = E_OK;
+	if (reader->chunk_pos == reader->chunk_frames)
+	{
+		size_t chunk_capacity = reader->reference_interval * (READ_CHUNK_FRAMES / reader->reference_interval > 0 ? READ_CHUNK_FRAMES / reader->reference_interval : 1);
+		long read_data;
+		
+		if (reader->end_of_stream)
+		{
+			return false;
+		}
+		read_data = wav_read(reader->infile, reader->chunk, chunk_capacity * reader->block_length, err);
+		if (*err == E_END_OF_STREAM)
+		{
+			reader->end_of_stream = true;
+			*err = E_OK;
+		}
+		if (*err != E_OK)
+		{
+			return false;
+		}
+		reader->chunk_frames = read_data / reader->block_length;
+		reader->chunk_pos = 0;
+		if (reader->chunk_frames == 0)
+		{
+			return false;
+		}
+	}
+	
+	group->start = reader->next_frame;
+	group->length = reader->chunk_frames - reader->chunk_pos;
+	if (group->length > reader->reference_interval)
+	{
+		group->length = reader->reference_interval;
+	}
+	frames = reader->chunk + frame_size * reader->chunk_pos;
+	memcpy(group->reference, frames, sizeof(group->reference));
+	for (n = 0; n < reader->num_channels; n++)
+	{
+		samples[n] = (sample_t *)(group + 1) + n * group_capacity;
+	}
+	switch (reader->format)
+	{
+	case W_U8:
+		sample_decode_u8_multichannel(samples, frames, group->length * reader->block_length, reader->num_channels);
+		break;
+	case W_S16LE:
+		sample_decode_s16_multichannel(samples, (int16_t *)frames, group->length * reader->block_length, reader->num_channels);
+		break;
+	default:
+		// unreachable
+		break;
+	}
+	
+	reader->chunk_pos += group->length;
+	reader->next_frame += group->length;
+	return true;
+}
+
+/* ------------------------------------------------------------------------- */
+// Writes the next frame drained from the reorder buffer to the output file, right
+// after the previous one.
+static void
+write_frame (void *item, size_t index, void *context)
+{
+	encoded_frame *frame = item;
+	frame_writer *writer = context;
+	err_t err;
+	int n;
+	
+	(void) index;
+	for (n = 0; n < writer->num_channels; n++)
+	{
+		err = wav_write_ssdpcm_block(writer->outfile, frame->reference, frame->slopes[n], (uint8_t *)(frame + 1) + n * writer->code_size, -1, n);
+		if (err != E_OK)
+		{
+			char err_msg[256];
+			int errno_copy = errno;
+			snprintf(err_msg, 256, "Write error (%s)", error_enum_strs[err]);
+			// Try to properly close the WAV file anyway
+			wav_close(writer->outfile, &err);
+			exit_error(err_msg, strerror(errno_copy));
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+// Unpacks the codewords of a block from its code, as stored in the file.
+static void
+unpack_codes (ssdpcm_block_mode mode, uint8_t *code, size_t code_size, codeword_t *deltas, long block_length)
+{
+	bitstream_buffer bitpacker;
+	err_t err;
+	long i;
+	
+	memset(&bitpacker, 0, sizeof(bitstream_buffer));
+	bitpacker.byte_buf.buffer = code;
+	bitpacker.byte_buf.buffer_size = code_size;
+	switch (mode)
+	{
+	case SS_SS1:
+	case SS_SS1C:
+		for (i = 0; i < block_length; i++)
+		{
+			err = get_bits_msbfirst(&deltas[i], &bitpacker, 1);
+			if (err != E_OK)
+			{
+				exit_error("Runtime error: get_bits_msbfirst returned non-ok status", error_enum_strs[err]);
+			}
+		}
+		break;
+	case SS_SS2:
+		for (i = 0; i < block_length; i++)
+		{
+			err = get_bits_msbfirst(&deltas[i], &bitpacker, 2);
+			if (err != E_OK)
+			{
+				exit_error("Runtime error: get_bits_msbfirst returned non-ok status", error_enum_strs[err]);
+			}
+		}
+		break;
+	case SS_SS1_6:
+		range_decode_ss1_6(code, deltas, code_size);
+		break;
+	case SS_SS2_3:
+		range_decode_ss2_3(code, deltas, code_size);
+		break;
+	case SS_SS3:
+		range_decode_ss3(code, deltas, code_size);
+		break;
+	default:
+		// unreachable
+		debug_assert(0 && "unexpected SSDPCM mode");
+		break;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+// Returns where the data of a frame in the mapped input file starts, given the frame
+// index and the channel.
+static const uint8_t *
+frame_block_data (const frame_decoder *dec, int64_t index, int channel)
+{
+	int64_t offset = wav_get_ssdpcm_frame_offset(dec->infile, index);
+	
+	if (wav_ssdpcm_frame_has_reference(dec->infile, index))
+	{
+		offset += dec->sample_size * dec->num_channels;
+	}
+	return dec->data + offset + channel * (dec->slopes_size + dec->code_size);
+}
+
+/* ------------------------------------------------------------------------- */
+// Decodes the reference samples of a frame in the mapped input file.
+static void
+read_frame_reference (const frame_decoder *dec, int64_t index, sample_t *initial_samples)
+{
+	uint8_t reference[4];
+	int n;
+	
+	debug_assert(wav_ssdpcm_frame_has_reference(dec->infile, index));
+	memcpy(reference, dec->data + wav_get_ssdpcm_frame_offset(dec->infile, index), dec->sample_size * dec->num_channels);
+	for (n = 0; n < dec->num_channels; n++)
+	{
+		if (dec->format == W_U8)
+		{
+			sample_decode_u8(&initial_samples[n], reference + n, 1);
+		}
+		else
+		{
+			sample_decode_s16(&initial_samples[n], (int16_t *)reference + n, 1);
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+// Decodes the slopes of a channel's block in a frame of the mapped input file, and
+// if a code buffer is given, unpacks the block's codewords too.
+static void
+read_frame_block (const frame_decoder *dec, int64_t index, int channel, ssdpcm_block *block, uint8_t *code)
+{
+	const uint8_t *src = frame_block_data(dec, index, channel);
+	uint8_t slope_bytes[16];
+	int half = dec->num_deltas / 2;
+	int i;
+	
+	memcpy(slope_bytes, src, dec->slopes_size);
+	if (dec->format == W_U8)
+	{
+		sample_decode_u8(block->slopes, slope_bytes, half);
+	}
+	else
+	{
+		sample_decode_u16(block->slopes, (uint16_t *)slope_bytes, half);
+	}
+	for (i = 0; i < half; i++)
+	{
+		block->slopes[i + half] = -block->slopes[i];
+	}
+	if (code != NULL)
+	{
+		memcpy(code, src + dec->slopes_size, dec->code_size);
+		unpack_codes(dec->mode, code, dec->code_size, block->deltas, dec->block_length);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+// Decodes the block of each channel in a frame straight from its code in the mapped
+// input file, given the blocks with their initial samples and slopes, and stores the
+// result in the output buffer. Each block's initial sample is left at its last sample,
+// before the comb filter, so the next frame can be decoded from there.
+static void
+decode_frame (const frame_decoder *dec, int64_t index, ssdpcm_block *block)
+{
+	uint8_t *dest = dec->output + wav_get_sizeof(dec->outfile, index * dec->block_length);
+	int n;
+	
+	for (n = 0; n < dec->num_channels; n++)
+	{
+		const uint8_t *code = frame_block_data(dec, index, n) + dec->slopes_size;
+		void *out = (dec->format == W_U8) ? (void *)(dest + n) : (void *)((int16_t *)dest + n);
+		block[n].initial_sample = dec->decode_packed(out, dec->num_channels, code, dec->code_size, &block[n]);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+// Decodes a file with reference samples every reference_interval frames, with each
+// thread taking whole groups of frames that start at a reference sample, since they
+// can be decoded on their own.
+static void
+decode_groups (const frame_decoder *dec, int64_t num_frames, uint8_t reference_interval)
+{
+	int64_t num_groups = (num_frames + reference_interval - 1) / reference_interval;
+	int64_t g;
+
+#pragma omp parallel
+	{
+		sample_t slopes[2][16];
+		ssdpcm_block block[2];
+		sample_t initial_samples[2];
+		int n;
+		
+		for (n = 0; n < dec->num_channels; n++)
+		{
+			memset(slopes[n], 0, sizeof(slopes[n]));
+			block[n].deltas = NULL;
+			block[n].slopes = slopes[n];
+			block[n].length = dec->block_length;
+			block[n].num_deltas = dec->num_deltas;
+		}
+
+#pragma omp for schedule(static)
+		for (g = 0; g < num_groups; g++)
+		{
+			int64_t f = g * reference_interval;
+			
+			read_frame_reference(dec, f, initial_samples);
+			for (n = 0; n < dec->num_channels; n++)
+			{
+				block[n].initial_sample = initial_samples[n];
+			}
+			for (; f < (g + 1) * reference_interval && f < num_frames; f++)
+			{
+				for (n = 0; n < dec->num_channels; n++)
+				{
+					read_frame_block(dec, f, n, &block[n], NULL);
+				}
+				decode_frame(dec, f, block);
+			}
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+// Decodes a file with a single reference sample at the start in parallel. Since
+// decoding is a running sum of the slopes, it's done in two phases: first the sum of
+// each block's slopes is found, with the codewords of every block unpacked in
+// parallel; then, after an exclusive scan of the sums gives the initial sample of each
+// block, the blocks are decoded in parallel too, straight from their code.
+static void
+decode_prefix_sum (const frame_decoder *dec, int64_t num_frames)
+{
+	size_t num_blocks = num_frames * dec->num_channels;
+	sample_t *initial_samples = malloc(sizeof(sample_t) * num_blocks);
+	sample_t running_sum[2];
+	int64_t f;
+	int n;
+
+#pragma omp parallel
+	{
+		sample_t slopes[16] = {0};
+		ssdpcm_block block;
+		uint8_t *code = malloc(dec->code_size);
+		
+		block.deltas = malloc(sizeof(codeword_t) * dec->block_length);
+		block.slopes = slopes;
+		block.length = dec->block_length;
+		block.num_deltas = dec->num_deltas;
+		block.initial_sample = 0;
+
+#pragma omp for schedule(static)
+		for (f = 0; f < num_frames; f++)
+		{
+			int channel;
+			for (channel = 0; channel < dec->num_channels; channel++)
+			{
+				read_frame_block(dec, f, channel, &block, code);
+				initial_samples[f * dec->num_channels + channel] = ssdpcm_block_sum(&block);
+			}
+		}
+		free(block.deltas);
+		free(code);
+	}
+	
+	read_frame_reference(dec, 0, running_sum);
+	for (f = 0; f < num_frames; f++)
+	{
+		for (n = 0; n < dec->num_channels; n++)
+		{
+			sample_t sum = initial_samples[f * dec->num_channels + n];
+			initial_samples[f * dec->num_channels + n] = running_sum[n];
+			running_sum[n] += sum;
+		}
+	}
+
+#pragma omp parallel
+	{
+		sample_t slopes[2][16];
+		ssdpcm_block block[2];
+		int channel;
+		
+		for (channel = 0; channel < dec->num_channels; channel++)
+		{
+			memset(slopes[channel], 0, sizeof(slopes[channel]));
+			block[channel].deltas = NULL;
+			block[channel].slopes = slopes[channel];
+			block[channel].length = dec->block_length;
+			block[channel].num_deltas = dec->num_deltas;
+		}
+
+#pragma omp for schedule(static)
+		for (f = 0; f < num_frames; f++)
+		{
+			for (channel = 0; channel < dec->num_channels; channel++)
+			{
+				block[channel].initial_sample = initial_samples[f * dec->num_channels + channel];
+				read_frame_block(dec, f, channel, &block[channel], NULL);
+			}
+			decode_frame(dec, f, block);
+		}
+	}
+	
+	free(initial_samples);
+}
+
+/* ------------------------------------------------------------------------- */
+// Decodes a file in parallel. The input file is mapped to memory, and the threads
+// decode frames straight into their place in the output buffer, which is written out
+// at once in the end.
+// Returns false without decoding anything if the file can't be mapped to memory.
+static bool
+decode_parallel (wav_handle *infile, wav_handle *outfile, ssdpcm_block_mode mode, long block_length, int num_deltas, int num_channels)
+{
+	err_t err;
+	frame_decoder dec;
+	uint8_t reference_interval = wav_get_ssdpcm_reference_interval(infile, &err);
+	int64_t num_frames = wav_get_ssdpcm_num_frames(infile, &err);
+	
+	dec.data = wav_map_data(infile, &err);
+	if (dec.data == NULL)
+	{
+		return false;
+	}
+	dec.infile = infile;
+	dec.outfile = outfile;
+	dec.mode = mode;
+	dec.format = wav_get_ssdpcm_output_format(infile, &err);
+	dec.block_length = block_length;
+	dec.num_deltas = num_deltas;
+	dec.num_channels = num_channels;
+	dec.sample_size = (dec.format == W_U8) ? 1 : 2;
+	dec.slopes_size = dec.sample_size * (num_deltas / 2);
+	dec.code_size = wav_get_ssdpcm_code_bytes_per_block(infile, &err);
+	dec.decode_packed = ssdpcm_block_decode_packed_select(mode, dec.format);
+	if (dec.decode_packed == NULL)
+	{
+		exit_error("Input file has an unsupported SSDPCM mode or sample format", NULL);
+	}
+	dec.output = malloc(wav_get_sizeof(outfile, num_frames * block_length));
+	
+	fprintf(stderr, "\rDecoding in parallel with %d threads.\n", omp_get_max_threads());
+	if (num_frames > 0)
+	{
+		if (reference_interval == 0)
+		{
+			decode_prefix_sum(&dec, num_frames);
+		}
+		else
+		{
+			decode_groups(&dec, num_frames, reference_interval);
+		}
+	}
+	
+	wav_write(outfile, dec.output, num_frames * block_length, 0, &err);
+	if (err != E_OK)
+	{
+		char err_msg[256];
+		int errno_copy = errno;
+		snprintf(err_msg, 256, "Write error (%s)", error_enum_strs[err]);
+		// Try to properly close the WAV file anyway
+		wav_close(outfile, &err);
+		exit_error(err_msg, strerror(errno_copy));
+	}
+	free(dec.output);
+	return true;
+}
+
+// Usage text, up to the list of search strategies.
 static const char usage[] = "\
-\033[97mUsage:\033[0m encoder_parallel (mode) infile.wav outfile.aud\n\
+\033[97mUsage:\033[0m encoder_parallel (mode) infile.wav outfile.aud [-s|--search strategy]\n\
+       [--max-candidates-per-block count] [--deadline-ms-per-block milliseconds]\n\
+       [--target-sse error] [--target-snr dB] [--block-cache [entries]]\n\
+       [--cache-dir directory] [-k|--keyframe-interval frames]\n\
 This encoder takes advantage of multithreading to accelerate encoding of the\n\
 higher quality modes, such as ss2, ss2.3 and ss3. For lower quality modes,\n\
 usage of the normal encoder is recommended.\n\
@@ -62,10 +564,53 @@ usage of the normal encoder is recommended.\n\
   PCM WAV file for the encoding modes, or an encoded .aud SSDPCM file for the\n\
   decode mode.\n\
 - \033[96moutfile.aud\033[0m is the path for the encoded output file, or the\n\
-  decoded WAV file in the case of the decode mode.";
+  decoded WAV file in the case of the decode mode.\n\
+- \033[96m-s\033[0m/\033[96m--search\033[0m selects how the slopes of each block are searched for:\n\
+";
+
+// Rest of the usage text, after the list of search strategies.
+static const char usage_tail[] = "\
+  The \033[96mbinary-warm\033[0m search of the normal encoder needs the blocks to be\n\
+  encoded in order, so it's not available here.\n\
+- \033[96m--max-candidates-per-block\033[0m and \033[96m--deadline-ms-per-block\033[0m limit the\n\
+  search of each block to a number of slope sets or to a wall time (which can\n\
+  be fractional). When the limit is hit, the block is encoded with the best\n\
+  slopes found so far. The number of blocks that hit it is printed at the end.\n\
+  With a deadline, the output depends on the speed of the machine.\n\
+- \033[96m--target-sse\033[0m and \033[96m--target-snr\033[0m stop the search of a block as soon as\n\
+  its error is good enough: a sum of squared errors, or a signal-to-noise ratio\n\
+  in dB relative to the block's own energy. Quiet, easy blocks then take a\n\
+  fraction of the search, while hard ones still get all of it.\n\
+- \033[96m--block-cache\033[0m reuses the encoding of earlier blocks with exactly the same\n\
+  input, as found in loops and repeated sounds, instead of searching again.\n\
+  This takes an optional argument with the maximum number of blocks kept\n\
+  (16384 by default, about 1 KiB each).\n\
+- \033[96m--cache-dir\033[0m keeps a copy of every encoded file in the given directory,\n\
+  named after a hash of the input file, the mode, the search settings and the\n\
+  encoder version. Encoding the same input with the same settings again just\n\
+  copies the cached file, which is identical to encoding it from scratch.\n\
+- \033[96m-k\033[0m/\033[96m--keyframe-interval\033[0m stores a reference sample only every given number\n\
+  of frames (1 to 255) instead of on every frame. The frames in between are\n\
+  encoded one after the other by the same thread, just like the normal encoder\n\
+  does. With an interval around 64, the files are barely larger than the\n\
+  normal encoder's, and there's still plenty of work to split across threads.\n\
+  The default is 1.";
 
+/* ------------------------------------------------------------------------- */
+// Prints the usage text, with the list of search strategies, and exits.
+static void
+exit_usage (void)
+{
+	fprintf(stderr, "\nOof!\n%s", usage);
+	ssdpcm_search_print_strategies(false);
+	fprintf(stderr, "%s\n", usage_tail);
+	exit(1);
+}
 
 
+
+#define BLOCK_CACHE_DEFAULT_ENTRIES 16384
+
 int
 main (int argc, char **argv)
 {
@@ -76,31 +621,150 @@ main (int argc, char **argv)
 	// use pragma atomic capture to read and increment
 	size_t block_count = 0;
 	
+	// Groups of frames read by the reader thread
+	frame_queue queue;
+	frame_reader reader = {0};
+	size_t group_size = 0;
+	
+	// Encoded frames waiting to be written in order
+	frame_reorder_buffer reorder;
+	frame_writer writer;
+	size_t frame_size = 0;
+	
 	// Global read-only variables (during the encode loop)
 	char *infile_name;
 	char *outfile_name;
 	wav_sample_fmt format;
 	ssdpcm_block_mode mode;
 	uint32_t sample_rate;
-	size_t code_buffer_size;
+	size_t code_buffer_size = 0;
 	long block_length;
 	int num_deltas;
 	sigma_tracker_methods sigma_methods = NULL;
+	ssdpcm_search_methods search = ssdpcm_search_binary_search;
+	ssdpcm_search_budget budget = {0};
+	const char *cache_dir = NULL;
+	ssdpcm_file_cache_key cache_key;
 	int num_threads;
+	int i;
 	bool stereo = false;
 	bool comb_filter = false;
 	bool decode_mode = false;
-	bool has_reference_sample_on_every_block = false;
+	uint8_t reference_interval = 1;
 	
 	// Thread-local variables
-
+	
 	err_t err;
 	
-	if (argc != 4)
+	if (argc < 4)
 	{
-		exit_error(usage, NULL);
+		exit_usage();
 	}
-
+	
+	for (i = 4; i < argc; i++)
+	{
+		if (!strcmp("-s", argv[i]) || !strcmp("--search", argv[i]))
+		{
+			if (i + 1 >= argc)
+			{
+				exit_usage();
+			}
+			search = ssdpcm_search_find(argv[++i]);
+			if (search == NULL)
+			{
+				fprintf(stderr, "Unknown search strategy '%s'.\n", argv[i]);
+				exit_usage();
+			}
+			if (search->sequential)
+			{
+				fprintf(stderr, "Search strategy '%s' can't be used by the parallel encoder.\n", argv[i]);
+				exit_usage();
+			}
+		}
+		else if (!strcmp("--max-candidates-per-block", argv[i]))
+		{
+			if (i + 1 >= argc || sscanf(argv[++i], "%" SCNu64, &budget.max_candidates) != 1 || budget.max_candidates == 0)
+			{
+				fprintf(stderr, "Invalid number of candidates per block.\n");
+				exit_usage();
+			}
+		}
+		else if (!strcmp("--deadline-ms-per-block", argv[i]))
+		{
+			double deadline_ms;
+			if (i + 1 >= argc || sscanf(argv[++i], "%lf", &deadline_ms) != 1 || !(deadline_ms > 0))
+			{
+				fprintf(stderr, "Invalid deadline per block.\n");
+				exit_usage();
+			}
+			budget.max_nanoseconds = deadline_ms * 1e6 < 1 ? 1 : deadline_ms * 1e6;
+		}
+		else if (!strcmp("--block-cache", argv[i]))
+		{
+			size_t cache_entries = BLOCK_CACHE_DEFAULT_ENTRIES;
+			if (i + 1 < argc && argv[i + 1][0] != '-')
+			{
+				if (sscanf(argv[++i], "%zu", &cache_entries) != 1 || cache_entries == 0)
+				{
+					fprintf(stderr, "Invalid block cache size '%s'.\n", argv[i]);
+					exit_usage();
+				}
+			}
+			if (!ssdpcm_block_cache_enabled())
+			{
+				ssdpcm_block_cache_init(cache_entries);
+			}
+		}
+		else if (!strcmp("-k", argv[i]) || !strcmp("--keyframe-interval", argv[i]))
+		{
+			unsigned long interval = 0;
+			char *end = NULL;
+			
+			if (i + 1 < argc)
+			{
+				errno = 0;
+				interval = strtoul(argv[++i], &end, 10);
+			}
+			// Out of range values, including negative ones, which strtoul() wraps around, are rejected
+			if (end == NULL || end == argv[i] || *end != '\0' || errno != 0 || interval < 1 || interval > UINT8_MAX)
+			{
+				fprintf(stderr, "Invalid keyframe interval.\n");
+				exit_usage();
+			}
+			reference_interval = interval;
+		}
+		else if (!strcmp("--cache-dir", argv[i]))
+		{
+			if (i + 1 >= argc)
+			{
+				exit_usage();
+			}
+			cache_dir = argv[++i];
+		}
+		else if (!strcmp("--target-sse", argv[i]))
+		{
+			if (i + 1 >= argc || sscanf(argv[++i], "%" SCNu64, &budget.target_error) != 1 || budget.target_error == 0)
+			{
+				fprintf(stderr, "Invalid target error.\n");
+				exit_usage();
+			}
+		}
+		else if (!strcmp("--target-snr", argv[i]))
+		{
+			if (i + 1 >= argc || sscanf(argv[++i], "%lf", &budget.target_snr_db) != 1 || budget.target_snr_db == 0)
+			{
+				fprintf(stderr, "Invalid target SNR.\n");
+				exit_usage();
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Invalid argument '%s'.\n", argv[i]);
+			exit_usage();
+		}
+	}
+	ssdpcm_search_set_budget(&budget);
+	
 	if (!strcmp("ss1", argv[1]))
 	{
 		mode = SS_SS1;
@@ -145,7 +809,7 @@ main (int argc, char **argv)
 	else
 	{
 		num_deltas = 0;
-		exit_error(usage, NULL);
+		exit_usage();
 	}
 	
 	infile_name = argv[2];
@@ -225,6 +889,29 @@ main (int argc, char **argv)
 		break;
 	}
 	
+	if (cache_dir != NULL && !decode_mode)
+	{
+		ssdpcm_file_cache_key_init(&cache_key, "encoder_parallel");
+		ssdpcm_file_cache_key_add(&cache_key, argv[1], strlen(argv[1]) + 1);
+		ssdpcm_file_cache_key_add(&cache_key, &block_length, sizeof(block_length));
+		ssdpcm_file_cache_key_add(&cache_key, search->name, strlen(search->name) + 1);
+		ssdpcm_file_cache_key_add(&cache_key, &budget.max_candidates, sizeof(budget.max_candidates));
+		ssdpcm_file_cache_key_add(&cache_key, &budget.max_nanoseconds, sizeof(budget.max_nanoseconds));
+		ssdpcm_file_cache_key_add(&cache_key, &budget.target_error, sizeof(budget.target_error));
+		ssdpcm_file_cache_key_add(&cache_key, &budget.target_snr_db, sizeof(budget.target_snr_db));
+		ssdpcm_file_cache_key_add(&cache_key, &reference_interval, sizeof(reference_interval));
+		if (!ssdpcm_file_cache_key_add_file(&cache_key, infile_name))
+		{
+			exit_error("Could not read input file. errno", strerror(errno));
+		}
+		if (ssdpcm_file_cache_fetch(cache_dir, &cache_key, infile_name, outfile_name))
+		{
+			wav_close(infile, &err);
+			fprintf(stderr, "Reused the cached encoding from '%s'.\nDone.\n", cache_dir);
+			return 0;
+		}
+	}
+	
 	outfile = wav_open(outfile, outfile_name, W_CREATE, &err);
 	if (outfile == NULL)
 	{
@@ -239,11 +926,10 @@ main (int argc, char **argv)
 	if (decode_mode)
 	{
 		wav_set_format(outfile, format);
-		has_reference_sample_on_every_block = wav_ssdpcm_has_reference_sample_on_every_block(infile, &err);
 	}
 	else
 	{
-		wav_init_ssdpcm(outfile, format, mode, block_length, true);
+		wav_init_ssdpcm(outfile, format, mode, block_length, reference_interval);
 		code_buffer_size = wav_get_ssdpcm_code_bytes_per_block(outfile, &err);
 	}
 	
@@ -251,17 +937,46 @@ main (int argc, char **argv)
 	wav_seek(infile, 0, SEEK_SET);
 	wav_seek(outfile, 0, SEEK_SET);
 	
-
-	// HACK: Decode serially, because it's faster lol
-	if (decode_mode || has_reference_sample_on_every_block)
+	
+	if (decode_mode && decode_parallel(infile, outfile, mode, block_length, num_deltas, stereo + 1))
 	{
-		omp_set_num_threads(1);
+		wav_close(infile, &err);
+		wav_close(outfile, &err);
+		fprintf(stderr, "Done.\n");
+		free(infile);
+		free(outfile);
+		return 0;
 	}
 	
+	// Decode serially if the input file couldn't be mapped to memory
+	if (decode_mode)
+	{
+		omp_set_num_threads(1);
+	}
+	else
+	{
+		reader.infile = infile;
+		reader.format = format;
+		reader.block_length = block_length;
+		reader.reference_interval = reference_interval;
+		reader.num_channels = stereo + 1;
+		reader.chunk = malloc(wav_get_sizeof(infile, (READ_CHUNK_FRAMES + reference_interval) * block_length));
+		group_size = sizeof(frame_group) + sizeof(sample_t) * reference_interval * block_length * (stereo + 1);
+		frame_queue_init(&queue, QUEUED_GROUPS_PER_THREAD * omp_get_max_threads(), group_size);
+		writer.outfile = outfile;
+		writer.num_channels = stereo + 1;
+		writer.code_size = code_buffer_size;
+		frame_size = sizeof(encoded_frame) + code_buffer_size * (stereo + 1);
+		frame_reorder_init(&reorder, (QUEUED_GROUPS_PER_THREAD + 1) * omp_get_max_threads() * reference_interval, frame_size, &write_frame, &writer);
+	}
+
 #pragma omp parallel firstprivate(err)
 	{
 		void *code_buffer[2] = {NULL, NULL};
 		void *sample_conv_buffer = NULL;
+		frame_group *group = NULL;
+		encoded_frame *frame = NULL;
+		bool reader_thread = false;
 		bitstream_buffer bitpacker;
 		sample_t *sample_buffer[2] = {NULL, NULL};
 		codeword_t *delta_buffer[2] = {NULL, NULL};
@@ -269,17 +984,18 @@ main (int argc, char **argv)
 		long read_data = 0;
 		ssdpcm_block block[2];
 		size_t block_index = 0;
+		size_t group_pos = 0;
 		sigma_tracker sigma;
 		int n;
 		
 		sigma.methods = sigma_methods;
 		sigma.methods->alloc(&sigma.state);
-
+		
 		for (n = 0; n <= stereo; n++)
 		{
-			memset(slopes, 0, sizeof(sample_t) * 16);
+			memset(slopes[n], 0, sizeof(sample_t) * 16);
 		}
-
+		
 		if (decode_mode)
 		{
 			sample_conv_buffer = malloc(wav_get_sizeof(outfile, block_length * (stereo + 1)));
@@ -287,8 +1003,12 @@ main (int argc, char **argv)
 		else
 		{
 			sample_conv_buffer = malloc(wav_get_sizeof(infile, block_length * (stereo + 1)));
+			group = malloc(group_size);
+			frame = malloc(frame_size);
+			group->length = 0;
 			if (omp_get_thread_num() == 0)
 			{
+				reader_thread = true;
 				num_threads = omp_get_num_threads();
 				fprintf(stderr, "\rEncoding in parallel with %d threads.\n", num_threads);
 			}
@@ -303,71 +1023,105 @@ main (int argc, char **argv)
 			block[n].length = block_length;
 			block[n].num_deltas = num_deltas;
 		}
-
+		
 		memset(&bitpacker, 0, sizeof(bitstream_buffer));
 		bitpacker.byte_buf.buffer_size = code_buffer_size;
-
+		
 		while (1 || (err == E_OK && ((decode_mode) || (read_data == block_length))))
 		{
 			
 			uint8_t initial_sample_temp[4];
 			if (!decode_mode)
 			{
-#pragma omp critical
+				if (group_pos == group->length)
 				{
-#pragma omp atomic capture
-					{ block_index = block_count; block_count++; }
-					read_data = wav_read(infile, sample_conv_buffer, block_length, &err);
-				}
-				if (err != E_OK)
-				{
-					if (err == E_END_OF_STREAM)
+					bool have_group = false;
+					
+					// The reader thread fills up the queue, and then takes the group at its
+					// front like the others. Groups are taken in order, so that the oldest
+					// frame not yet written is always being encoded, and the reorder buffer
+					// can't wait on a frame that's still queued.
+					while (reader_thread && !have_group)
 					{
-						break;
+						while (reader_thread && !frame_queue_full(&queue))
+						{
+							if (read_group(&reader, group, &err))
+							{
+								frame_queue_push(&queue, group);
+							}
+							else
+							{
+								reader_thread = false;
+								frame_queue_close(&queue);
+							}
+						}
+						have_group = frame_queue_try_pop(&queue, group);
 					}
-					char err_msg[256];
-					int errno_copy = errno;
-					snprintf(err_msg, 256, "Read error (%s)", error_enum_strs[err]);
-					// Try to properly close the WAV file anyway
+					if (err != E_OK)
+					{
+						char err_msg[256];
+						int errno_copy = errno;
+						snprintf(err_msg, 256, "Read error (%s)", error_enum_strs[err]);
+						// Try to properly close the WAV file anyway
 #pragma omp critical
-					wav_close(outfile, &err);
-					exit_error(err_msg, strerror(errno_copy));
+						wav_close(outfile, &err);
+						exit_error(err_msg, strerror(errno_copy));
+					}
+					if (!have_group && !frame_queue_pop(&queue, group))
+					{
+						break;
+					}
+					group_pos = 0;
 				}
 				
-				memcpy(initial_sample_temp, sample_conv_buffer, sizeof(initial_sample_temp));
+				block_index = group->start + group_pos;
+				for (n = 0; n <= stereo; n++)
+				{
+					memcpy(sample_buffer[n], (sample_t *)(group + 1) + (n * reference_interval + group_pos) * block_length, sizeof(sample_t) * block_length);
+				}
+				memcpy(initial_sample_temp, group->reference, sizeof(initial_sample_temp));
+				group_pos++;
+				
 				switch (format)
 				{
 				case W_U8:
-					sample_decode_u8_multichannel(sample_buffer, (uint8_t *)sample_conv_buffer, block_length, stereo + 1);
-					for (n = 0; n <= stereo; n++)
+					if (wav_ssdpcm_frame_has_reference(outfile, block_index))
 					{
-						block[n].initial_sample = initial_sample_temp[n];
+						for (n = 0; n <= stereo; n++)
+						{
+							block[n].initial_sample = initial_sample_temp[n];
+						}
 					}
 					break;
 				case W_S16LE:
-					sample_decode_s16_multichannel(sample_buffer, (int16_t *)sample_conv_buffer, block_length, stereo + 1);
-					for (n = 0; n <= stereo; n++)
+					if (wav_ssdpcm_frame_has_reference(outfile, block_index))
 					{
-						block[n].initial_sample = ((int16_t *)initial_sample_temp)[n];
+						for (n = 0; n <= stereo; n++)
+						{
+							block[n].initial_sample = ((int16_t *)initial_sample_temp)[n];
+						}
 					}
 					break;
 				default:
 					// unreachable
 					break;
 				}
-				
-				
+
+
 
 #pragma omp critical
 				fprintf(stderr, "\rEncoding block %lu...", block_index);
 				for (n = 0; n <= stereo; n++)
 				{
-					(void) ssdpcm_encode_binary_search(&block[n], sample_buffer[n], &sigma);
+					sample_t last_sample;
+					(void) ssdpcm_search_encode(search, &block[n], sample_buffer[n], &sigma);
 					ssdpcm_block_decode(sample_buffer[n], &block[n]);
+					last_sample = sample_buffer[n][block_length - 1];
 					if (comb_filter)
 					{
 						sample_filter_comb(sample_buffer[n], block_length, block[n].initial_sample);
 					}
+					block[n].initial_sample = last_sample;
 					
 					
 					bitpacker.byte_buf.buffer = code_buffer[n];
@@ -433,26 +1187,19 @@ main (int argc, char **argv)
 						// unreachable
 						break;
 					}
-				
-#pragma omp critical
-					err = wav_write_ssdpcm_block(outfile, initial_sample_temp, sample_conv_buffer, code_buffer[n], block_index, n);
-					if (err != E_OK)
-					{
-						char err_msg[256];
-						int errno_copy = errno;
-						snprintf(err_msg, 256, "Write error (%s)", error_enum_strs[err]);
-						// Try to properly close the WAV file anyway
-#pragma omp critical
-						wav_close(outfile, &err);
-						exit_error(err_msg, strerror(errno_copy));
-					}
+					memcpy(frame->slopes[n], sample_conv_buffer, sizeof(frame->slopes[n]));
+					memcpy((uint8_t *)(frame + 1) + n * code_buffer_size, code_buffer[n], code_buffer_size);
 				}
+				
+				memcpy(frame->reference, initial_sample_temp, sizeof(frame->reference));
+				frame_reorder_put(&reorder, block_index, frame);
 			}
-		
-		
+			
+			
 			if (decode_mode)
 			{
 				int i;
+				sample_t last_sample;
 //#pragma omp critical
 				{
 //#pragma omp atomic capture
@@ -486,15 +1233,15 @@ main (int argc, char **argv)
 					{
 					case W_U8:
 						sample_decode_u8(block[n].slopes, sample_conv_buffer + n * (num_deltas / 2) * 4, block[n].num_deltas / 2);
-						if (n == 0 && has_reference_sample_on_every_block)
+						if (n == 0 && wav_ssdpcm_frame_has_reference(infile, block_index))
 						{
 							sample_decode_u8(&block[0].initial_sample, initial_sample_temp, 1);
-							sample_decode_u8(&block[1].initial_sample, initial_sample_temp + 2, 1);
+							sample_decode_u8(&block[1].initial_sample, initial_sample_temp + 1, 1);
 						}
 						break;
 					case W_S16LE:
 						sample_decode_u16(block[n].slopes, sample_conv_buffer + n * (num_deltas / 2) * 4, block[n].num_deltas / 2);
-						if (n == 0 && has_reference_sample_on_every_block)
+						if (n == 0 && wav_ssdpcm_frame_has_reference(infile, block_index))
 						{
 							sample_decode_s16(&block[0].initial_sample, (int16_t *)initial_sample_temp, 1);
 							sample_decode_s16(&block[1].initial_sample, ((int16_t *)initial_sample_temp) + 1, 1);
@@ -505,59 +1252,22 @@ main (int argc, char **argv)
 						break;
 					}
 					
-					bitpacker.byte_buf.buffer = code_buffer[n];
-					bitpacker.byte_buf.offset = 0;
-					bitpacker.bit_index = 0;
-					switch (mode)
-					{
-					case SS_SS1:
-					case SS_SS1C:
-						for (i = 0; i < block_length; i++)
-						{
-							err = get_bits_msbfirst(&block[n].deltas[i], &bitpacker, 1);
-							if (err != E_OK)
-							{
-								exit_error("Runtime error: get_bits_msbfirst returned non-ok status", error_enum_strs[err]);
-							}
-						}
-						break;
-					case SS_SS2:
-						for (i = 0; i < block_length; i++)
-						{
-							err = get_bits_msbfirst(&block[n].deltas[i], &bitpacker, 2);
-							if (err != E_OK)
-							{
-								exit_error("Runtime error: get_bits_msbfirst returned non-ok status", error_enum_strs[err]);
-							}
-						}
-						break;
-					case SS_SS1_6:
-						range_decode_ss1_6((uint8_t *)code_buffer[n], block[n].deltas, code_buffer_size);
-						break;
-					case SS_SS2_3:
-						range_decode_ss2_3((uint8_t *)code_buffer[n], block[n].deltas, code_buffer_size);
-						break;
-					case SS_SS3:
-						range_decode_ss3((uint8_t *)code_buffer[n], block[n].deltas, code_buffer_size);
-						break;
-					default:
-						// unreachable
-						debug_assert(0 && "unexpected SSDPCM mode");
-						break;
-					}
+					unpack_codes(mode, (uint8_t *)code_buffer[n], code_buffer_size, block[n].deltas, block_length);
 					
 					for (i = 0; i < block[n].num_deltas / 2; i++)
 					{
 						block[n].slopes[i + block[n].num_deltas / 2] = -block[n].slopes[i];
 					}
-				
+
 //#pragma omp critical
 					fprintf(stderr, "\rDecoding block %lu...", block_index);
 					ssdpcm_block_decode(sample_buffer[n], &block[n]);
+					last_sample = sample_buffer[n][block_length - 1];
 					if (comb_filter)
 					{
 						sample_filter_comb(sample_buffer[n], block_length, block[n].initial_sample);
 					}
+					block[n].initial_sample = last_sample;
 				}
 				
 				switch (format)
@@ -572,7 +1282,7 @@ main (int argc, char **argv)
 					// unreachable
 					break;
 				}
-				
+
 //#pragma omp critical
 				wav_write(outfile, sample_conv_buffer, block_length, block_index * block_length, &err);
 				if (err != E_OK)
@@ -587,7 +1297,7 @@ main (int argc, char **argv)
 				}
 			}
 		}
-
+		
 		for (n = 0; n <= stereo; n++)
 		{
 			free(code_buffer[n]);
@@ -596,12 +1306,57 @@ main (int argc, char **argv)
 		}
 		sigma.methods->free(&(sigma.state));
 		free(sample_conv_buffer);
+		free(group);
+		free(frame);
+	}
+	
+	if (!decode_mode)
+	{
+		frame_reorder_drain(&reorder);
+		frame_reorder_free(&reorder);
+		frame_queue_free(&queue);
+		free(reader.chunk);
 	}
 	
 	wav_close(infile, &err);
 	wav_close(outfile, &err);
 	
+	if (cache_dir != NULL && !decode_mode)
+	{
+		if (!ssdpcm_file_cache_store(cache_dir, &cache_key, infile_name, outfile_name))
+		{
+			fprintf(stderr, "\nCould not store the encoded file in the cache directory '%s': %s", cache_dir, strerror(errno));
+		}
+	}
+	
+	if (!decode_mode)
+	{
+		ssdpcm_search_stats stats;
+		ssdpcm_search_get_stats(search, &stats);
+		if (stats.blocks)
+		{
+			fprintf(stderr, "\nSearch '%s': %.1f slope sets and %.3f ms per block.", search->name, (double)stats.candidates / stats.blocks, stats.nanoseconds / 1e6 / stats.blocks);
+			fprintf(stderr, "\nSearched %" PRIu64 " slope sets, %" PRIu64 " of them (%.1f%%) found in the memo cache.", stats.candidates, stats.memo_hits, stats.candidates ? 100.0 * stats.memo_hits / stats.candidates : 0.0);
+			if (budget.max_candidates || budget.max_nanoseconds)
+			{
+				fprintf(stderr, "\n%" PRIu64 " of %" PRIu64 " blocks (%.1f%%) ran out of search budget.", stats.out_of_budget, stats.blocks, 100.0 * stats.out_of_budget / stats.blocks);
+			}
+			if (ssdpcm_block_cache_enabled())
+			{
+				fprintf(stderr, "\n%" PRIu64 " of %" PRIu64 " blocks (%.1f%%) reused from the block cache.", stats.cache_hits, stats.blocks, 100.0 * stats.cache_hits / stats.blocks);
+			}
+			if (stats.flat_blocks)
+			{
+				fprintf(stderr, "\n%" PRIu64 " of %" PRIu64 " blocks (%.1f%%) were flat and skipped the search.", stats.flat_blocks, stats.blocks, 100.0 * stats.flat_blocks / stats.blocks);
+			}
+			if (budget.target_error || budget.target_snr_db != 0)
+			{
+				fprintf(stderr, "\n%" PRIu64 " of %" PRIu64 " blocks (%.1f%%) met the target error early.", stats.target_reached, stats.blocks, 100.0 * stats.target_reached / stats.blocks);
+			}
+		}
+	}
 	fprintf(stderr, "\nDone.\n");
+	ssdpcm_block_cache_free();
 	free(infile);
 	free(outfile);
 	
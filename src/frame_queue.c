@@ -0,0 +1,304 @@
+/*
+ * ssdpcm: implementation of the SSDPCM audio codec designed by Algorithm.
+ * Copyright (C) 2022-2025 Kagamiin~
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <types.h>
+#include <errors.h>
+#include <frame_queue.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sched.h>
+
+/* ------------------------------------------------------------------------- */
+static inline size_t
+load_ (size_t *value)
+{
+	size_t result;
+
+#pragma omp atomic read seq_cst
+	result = *value;
+	return result;
+}
+
+/* ------------------------------------------------------------------------- */
+static inline void
+store_ (size_t *value, size_t new_value)
+{
+	size_t old_value;
+	
+	// HACK: an atomic write would do, but GCC wrongly warns that new_value is unused
+#pragma omp atomic capture seq_cst
+	{
+		old_value = *value;
+		*value = new_value;
+	}
+	(void) old_value;
+}
+
+/* ------------------------------------------------------------------------- */
+// Takes the next ticket from the given end of the queue.
+static inline size_t
+take_ticket_ (size_t *counter)
+{
+	size_t ticket;
+
+#pragma omp atomic capture seq_cst
+	ticket = (*counter)++;
+	return ticket;
+}
+
+/* ------------------------------------------------------------------------- */
+// frame_queue_init: Initializes an empty queue with room for capacity items of
+// item_size bytes each.
+void
+frame_queue_init (frame_queue *q, size_t capacity, size_t item_size)
+{
+	size_t i;
+	
+	debug_assert(q != NULL);
+	debug_assert(capacity > 0);
+	
+	q->capacity = capacity;
+	q->item_size = item_size;
+	q->items = malloc(capacity * item_size);
+	q->sequence = malloc(capacity * sizeof(size_t));
+	for (i = 0; i < capacity; i++)
+	{
+		q->sequence[i] = i;
+	}
+	q->head = 0;
+	q->tail = 0;
+	q->end = SIZE_MAX;
+}
+
+/* ------------------------------------------------------------------------- */
+// frame_queue_free: Frees the queue's buffers. No thread may be using it anymore.
+void
+frame_queue_free (frame_queue *q)
+{
+	free(q->items);
+	free(q->sequence);
+}
+
+/* ------------------------------------------------------------------------- */
+// frame_queue_full: Checks if a push would have to wait for an item to be popped.
+// Only meaningful when there's a single thread pushing, since the answer may be out of
+// date as soon as another one pushes.
+bool
+frame_queue_full (frame_queue *q)
+{
+	size_t tail = load_(&q->tail);
+	
+	return load_(&q->sequence[tail % q->capacity]) != tail;
+}
+
+/* ------------------------------------------------------------------------- */
+// frame_queue_push: Copies an item to the back of the queue, waiting for room if it's
+// full. The queue must not have been closed.
+void
+frame_queue_push (frame_queue *q, const void *item)
+{
+	size_t ticket = take_ticket_(&q->tail);
+	size_t slot = ticket % q->capacity;
+	
+	debug_assert(load_(&q->end) == SIZE_MAX);
+	
+	while (load_(&q->sequence[slot]) != ticket)
+	{
+		sched_yield();
+	}
+	memcpy(q->items + slot * q->item_size, item, q->item_size);
+	store_(&q->sequence[slot], ticket + 1);
+}
+
+/* ------------------------------------------------------------------------- */
+// Claims the item at the front of the queue, if there's one, by moving the head past
+// it with a compare-and-swap. Unlike a ticket, this can fail without leaving a claim
+// behind. Returns true along with the item's position if it was claimed.
+static inline bool
+claim_front_ (frame_queue *q, size_t *ticket)
+{
+	size_t head = load_(&q->head);
+	size_t old_head;
+	
+	while (load_(&q->sequence[head % q->capacity]) == head + 1)
+	{
+#pragma omp atomic compare capture seq_cst
+		{
+			old_head = q->head;
+			if (q->head == head)
+			{
+				q->head = head + 1;
+			}
+		}
+		if (old_head == head)
+		{
+			*ticket = head;
+			return true;
+		}
+		head = old_head;
+	}
+	return false;
+}
+
+/* ------------------------------------------------------------------------- */
+// Copies a claimed item out of the queue and frees its slot.
+static inline void
+take_ (frame_queue *q, size_t ticket, void *item)
+{
+	size_t slot = ticket % q->capacity;
+	
+	memcpy(item, q->items + slot * q->item_size, q->item_size);
+	store_(&q->sequence[slot], ticket + q->capacity);
+}
+
+/* ------------------------------------------------------------------------- */
+// frame_queue_pop: Copies the item at the front of the queue to the given buffer and
+// removes it, waiting for one to be pushed if it's empty.
+// Returns false once the queue has been closed and every item pushed before that has
+// been popped.
+bool
+frame_queue_pop (frame_queue *q, void *item)
+{
+	size_t ticket;
+	
+	while (!claim_front_(q, &ticket))
+	{
+		if (load_(&q->head) >= load_(&q->end))
+		{
+			return false;
+		}
+		sched_yield();
+	}
+	take_(q, ticket, item);
+	return true;
+}
+
+/* ------------------------------------------------------------------------- */
+// frame_queue_try_pop: Same as frame_queue_pop(), but returns false right away if the
+// queue is empty.
+bool
+frame_queue_try_pop (frame_queue *q, void *item)
+{
+	size_t ticket;
+	
+	if (!claim_front_(q, &ticket))
+	{
+		return false;
+	}
+	take_(q, ticket, item);
+	return true;
+}
+
+/* ------------------------------------------------------------------------- */
+// frame_queue_close: Tells the threads popping from the queue that no more items will
+// be pushed. Must be called after every push has returned.
+void
+frame_queue_close (frame_queue *q)
+{
+	store_(&q->end, load_(&q->tail));
+}
+
+/* ------------------------------------------------------------------------- */
+// frame_reorder_init: Initializes an empty reorder buffer with room for capacity items
+// of item_size bytes each. The items are passed to the write function in order,
+// starting from index 0, along with the given context.
+void
+frame_reorder_init (frame_reorder_buffer *rb, size_t capacity, size_t item_size, frame_reorder_write_func write, void *context)
+{
+	size_t i;
+	
+	debug_assert(rb != NULL);
+	debug_assert(capacity > 0);
+	debug_assert(write != NULL);
+	
+	rb->capacity = capacity;
+	rb->item_size = item_size;
+	rb->items = malloc(capacity * item_size);
+	rb->sequence = malloc(capacity * sizeof(size_t));
+	for (i = 0; i < capacity; i++)
+	{
+		rb->sequence[i] = i;
+	}
+	rb->next = 0;
+	omp_init_lock(&rb->drain_lock);
+	rb->write = write;
+	rb->context = context;
+}
+
+/* ------------------------------------------------------------------------- */
+// frame_reorder_free: Frees the reorder buffer. Any items still in it are lost, so it
+// should be drained first.
+void
+frame_reorder_free (frame_reorder_buffer *rb)
+{
+	omp_destroy_lock(&rb->drain_lock);
+	free(rb->items);
+	free(rb->sequence);
+}
+
+/* ------------------------------------------------------------------------- */
+// frame_reorder_put: Copies the item with the given index to the reorder buffer, and
+// drains it unless another thread already is. If the item's slot is still taken by
+// the item capacity places before it, waits for that one to be written, helping
+// drain the buffer meanwhile.
+void
+frame_reorder_put (frame_reorder_buffer *rb, size_t index, const void *item)
+{
+	size_t slot = index % rb->capacity;
+	
+	while (load_(&rb->sequence[slot]) != index)
+	{
+		frame_reorder_drain(rb);
+		sched_yield();
+	}
+	memcpy(rb->items + slot * rb->item_size, item, rb->item_size);
+	store_(&rb->sequence[slot], index + 1);
+	frame_reorder_drain(rb);
+}
+
+/* ------------------------------------------------------------------------- */
+// frame_reorder_drain: Writes out the items that are next in order, as long as they
+// are in the buffer already. Returns right away if another thread is draining it.
+void
+frame_reorder_drain (frame_reorder_buffer *rb)
+{
+	size_t next;
+	
+	// An item put while the thread draining was giving up the lock would otherwise be
+	// left behind until the next put
+	do
+	{
+		if (!omp_test_lock(&rb->drain_lock))
+		{
+			return;
+		}
+		next = rb->next;
+		while (load_(&rb->sequence[next % rb->capacity]) == next + 1)
+		{
+			size_t slot = next % rb->capacity;
+			
+			rb->write(rb->items + slot * rb->item_size, next, rb->context);
+			store_(&rb->sequence[slot], next + rb->capacity);
+			next++;
+		}
+		store_(&rb->next, next);
+		omp_unset_lock(&rb->drain_lock);
+	}
+	while (load_(&rb->sequence[next % rb->capacity]) == next + 1);
+}
@@ -25,9 +25,9 @@ typedef struct
 {
 	sample_t initial_sample;
 	uint8_t num_deltas;
-
+	
 	sample_t *slopes;
-
+	
 	codeword_t *deltas;
 	size_t length;
 } ssdpcm_block;
@@ -41,5 +41,14 @@ typedef struct
 } ssdpcm_block_iterator;
 
 void ssdpcm_block_decode (sample_t *out, ssdpcm_block *block);
+sample_t ssdpcm_block_decode_u8 (uint8_t *out, size_t stride, ssdpcm_block *block);
+sample_t ssdpcm_block_decode_s16 (int16_t *out, size_t stride, ssdpcm_block *block);
+
+// Decodes a block straight from its code into output samples, stored every stride
+// samples. Returns the last decoded sample.
+typedef sample_t (*ssdpcm_block_decode_packed_func)(void *out, size_t stride, const uint8_t *code, size_t code_size, const ssdpcm_block *block);
+
+ssdpcm_block_decode_packed_func ssdpcm_block_decode_packed_select (ssdpcm_block_mode mode, wav_sample_fmt format);
+sample_t ssdpcm_block_sum (const ssdpcm_block *block);
 
 #endif
@@ -21,6 +21,7 @@
 
 #include "block.h"
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef struct sigma_tracker_methods_s
 {
@@ -55,12 +56,208 @@ typedef struct
 	sigma_tracker *sigma;
 } ssdpcm_encoder;
 
+// Block encoder with the same semantics as ssdpcm_block_encode_bounded().
+typedef uint64_t (*ssdpcm_block_encode_func)(ssdpcm_block *block, sample_t *in, sigma_tracker *sigma, uint64_t error_bound);
+
+// Maximum number of candidate slope sets evaluated by one call of a batch block encoder.
+#define SSDPCM_ENCODE_BATCH_SIZE 8
+
+// Batch block encoder with the same semantics as ssdpcm_block_encode_batch_bounded().
+typedef void (*ssdpcm_block_encode_batch_func)(
+	ssdpcm_block *block, sample_t *in, sigma_tracker *sigma, const sample_t *slopes, size_t num_candidates, uint64_t error_bound, uint64_t *errors);
+
+// Counters kept by a slope search strategy, accumulated over all of the blocks it encoded so far.
+typedef struct
+{
+	// Number of blocks encoded.
+	uint64_t blocks;
+	
+	// Number of candidate slope sets visited.
+	uint64_t candidates;
+	
+	// Number of candidates whose error metric was taken from the memo cache instead of encoding them again.
+	uint64_t memo_hits;
+	
+	// Wall time spent searching and encoding, in nanoseconds.
+	uint64_t nanoseconds;
+	
+	// Number of blocks whose search was cut short by the budget (see ssdpcm_search_set_budget()).
+	uint64_t out_of_budget;
+	
+	// Number of blocks whose search stopped early because the target error was met.
+	uint64_t target_reached;
+	
+	// Number of blocks flat enough to be encoded without a search (see ssdpcm_encode_flat_block()).
+	uint64_t flat_blocks;
+	
+	// Number of blocks reused from the block cache (see ssdpcm_block_cache_init()).
+	uint64_t cache_hits;
+	
+	// Number of blocks searched ahead of time with a guessed initial sample (see
+	// ssdpcm_search_encode_speculated()), and how many of them were right, only needed
+	// refining for the real initial sample, and had to be searched again.
+	uint64_t speculation_guesses;
+	uint64_t speculation_hits;
+	uint64_t speculation_refined;
+	uint64_t speculation_redone;
+} ssdpcm_search_stats;
+
+// Limits on the search of each block. A limit of 0 means no limit.
+typedef struct
+{
+	// Maximum number of candidate slope sets encoded; the ones taken from the memo cache don't count.
+	uint64_t max_candidates;
+	
+	// Maximum wall time, in nanoseconds.
+	uint64_t max_nanoseconds;
+	
+	// Error metric that is good enough for a block; the search stops as soon as it's met.
+	uint64_t target_error;
+	
+	// Same as target_error, but as a signal-to-noise ratio in dB, relative to the energy
+	// of the block around its mean. If both are set, the search stops at the larger error.
+	double target_snr_db;
+} ssdpcm_search_budget;
+
+// Counters of the block being searched by the calling thread. The searches add to
+// them; ssdpcm_search_encode() resets them before each block and collects them after.
+extern ssdpcm_search_stats ssdpcm_search_block_stats;
+#pragma omp threadprivate(ssdpcm_search_block_stats)
+
+typedef struct ssdpcm_search_methods_s
+{
+	// Name of the strategy, as given to the --search option.
+	const char *name;
+	
+	// One-line description of the strategy for the usage text (see ssdpcm_search_print_strategies()).
+	const char *description;
+	
+	// Searches for the slopes of an SSDPCM block (given preinitialized fields) and encodes it with them.
+	// Returns the accumulated error metric.
+	uint64_t (*encode)(ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma);
+	
+	// Whether the search starts from the slopes left in the block by the previous one,
+	// so the blocks must be encoded in order, one after the other.
+	bool sequential;
+} const *ssdpcm_search_methods;
+
+// Parameters of ssdpcm_encode_refine().
+typedef struct
+{
+	// Number of mutations to try.
+	unsigned int max_iterations;
+	
+	// Time limit for the refinement of a block, or 0 for no limit.
+	unsigned int max_microseconds;
+	
+	// Initial annealing temperature, relative to the block's error metric, or 0 for plain hill-climbing.
+	double temperature;
+} ssdpcm_refine_params;
+
+// Version of the encoder's output, part of every ssdpcm_file_cache_key. Bump it whenever a
+// change to the encoder alters the files it writes, so that older cached files stop being reused.
+#define SSDPCM_ENCODER_VERSION 3
+
+// Identifies one encoding of one input file: a 128-bit FNV-1a hash of the encoder, its settings
+// and the input, high half first.
+typedef struct
+{
+	uint64_t hash[2];
+} ssdpcm_file_cache_key;
+
 uint64_t ssdpcm_encode_bruteforce (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma);
 
 uint64_t ssdpcm_encode_binary_search (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma);
 
+uint64_t ssdpcm_encode_binary_search_grid (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, uint8_t grid_bits);
+
+uint64_t ssdpcm_encode_binary_search_warm (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma);
+
+uint64_t ssdpcm_encode_coordinate_descent (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma);
+
+bool ssdpcm_encode_flat_block (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma);
+
+uint64_t ssdpcm_encode_kmeans (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, unsigned int refine_iterations);
+
+uint64_t ssdpcm_encode_refine (ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, const ssdpcm_refine_params *params);
+
+ssdpcm_search_methods ssdpcm_search_find (const char *name);
+
+void ssdpcm_search_print_strategies (bool include_sequential);
+
+uint64_t ssdpcm_search_encode (ssdpcm_search_methods search, ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma);
+
+uint64_t ssdpcm_search_encode_speculated (
+	ssdpcm_search_methods search, ssdpcm_block *dest, sample_t *in, sigma_tracker *sigma, const ssdpcm_block *speculated, uint64_t speculated_metric, bool guessed);
+
+void ssdpcm_search_get_stats (ssdpcm_search_methods search, ssdpcm_search_stats *stats);
+
+void ssdpcm_search_set_budget (const ssdpcm_search_budget *budget);
+
+bool ssdpcm_search_is_limited (void);
+
+uint64_t ssdpcm_search_candidate_budget (void);
+
+bool ssdpcm_search_should_stop (void);
+
+void ssdpcm_search_report_metric (uint64_t metric);
+
+void ssdpcm_block_cache_init (size_t max_entries);
+
+bool ssdpcm_block_cache_enabled (void);
+
+bool ssdpcm_block_cache_lookup (ssdpcm_block *block, const sample_t *in, sigma_tracker *sigma, uint64_t *metric);
+
+void ssdpcm_block_cache_insert (const ssdpcm_block *block, const sample_t *in, sigma_tracker *sigma, uint64_t metric);
+
+void ssdpcm_block_cache_free (void);
+
+void ssdpcm_file_cache_key_init (ssdpcm_file_cache_key *key, const char *encoder_name);
+
+void ssdpcm_file_cache_key_add (ssdpcm_file_cache_key *key, const void *data, size_t length);
+
+bool ssdpcm_file_cache_key_add_file (ssdpcm_file_cache_key *key, const char *path);
+
+bool ssdpcm_file_cache_fetch (const char *cache_dir, const ssdpcm_file_cache_key *key, const char *infile_name, const char *outfile_name);
+
+bool ssdpcm_file_cache_store (const char *cache_dir, const ssdpcm_file_cache_key *key, const char *infile_name, const char *outfile_name);
+
 uint64_t ssdpcm_block_encode (ssdpcm_block *block, sample_t *in, sigma_tracker *sigma);
 
+uint64_t ssdpcm_block_encode_bounded (ssdpcm_block *block, sample_t *in, sigma_tracker *sigma, uint64_t error_bound);
+
+void ssdpcm_block_encode_batch_bounded (
+	ssdpcm_block *block, sample_t *in, sigma_tracker *sigma, const sample_t *slopes, size_t num_candidates, uint64_t error_bound, uint64_t *errors);
+
+ssdpcm_block_encode_func ssdpcm_block_encode_select (sigma_tracker_methods methods, uint8_t num_deltas);
+
+ssdpcm_block_encode_batch_func ssdpcm_block_encode_batch_select (sigma_tracker_methods methods, uint8_t num_deltas);
+
+/* ------------------------------------------------------------------------- */
+// Slope search strategies
+/* ------------------------------------------------------------------------- */
+
+// Tries every set of slopes up to the biggest difference between samples; only usable with few slopes
+extern ssdpcm_search_methods ssdpcm_search_bruteforce;
+
+// Multilevel grid search over the slopes (the default)
+extern ssdpcm_search_methods ssdpcm_search_binary_search;
+
+// Grid search in a narrow window around the previous block's slopes, with fallback to the full search
+extern ssdpcm_search_methods ssdpcm_search_binary_search_warm;
+
+// Slopes from clustering the differences between samples, refitted to the encoded block
+extern ssdpcm_search_methods ssdpcm_search_kmeans;
+
+// Coarse grid search followed by hill-climbing on the slopes
+extern ssdpcm_search_methods ssdpcm_search_refine;
+
+// One slope at a time, starting from the clustered slopes
+extern ssdpcm_search_methods ssdpcm_search_coordinate_descent;
+
+// All of the search strategies above, terminated by NULL
+extern const ssdpcm_search_methods ssdpcm_search_strategies[];
+
 /* ------------------------------------------------------------------------- */
 // Error tracking method implementations
 /* ------------------------------------------------------------------------- */
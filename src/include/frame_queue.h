@@ -0,0 +1,86 @@
+/*
+ * ssdpcm: implementation of the SSDPCM audio codec designed by Algorithm.
+ * Copyright (C) 2022-2025 Kagamiin~
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FRAME_QUEUE_H__
+#define __FRAME_QUEUE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <omp.h>
+
+// Bounded queue of fixed-size items, safe to push to and pop from on any number of
+// threads at once. Item i goes in slot i % capacity of the ring, whose sequence number
+// is i while it's free for it and i + 1 once it's been pushed there. Each push takes
+// the next position with an atomic increment; pops claim the item at the front with a
+// compare-and-swap instead, so that they can give up if the queue is empty.
+typedef struct
+{
+	size_t capacity;
+	size_t item_size;
+	uint8_t *items;
+	size_t *sequence;
+	size_t head;
+	size_t tail;
+	
+	// Number of items pushed before the queue was closed, or SIZE_MAX while it's open.
+	size_t end;
+} frame_queue;
+
+void frame_queue_init (frame_queue *q, size_t capacity, size_t item_size);
+
+void frame_queue_free (frame_queue *q);
+
+bool frame_queue_full (frame_queue *q);
+
+void frame_queue_push (frame_queue *q, const void *item);
+
+bool frame_queue_pop (frame_queue *q, void *item);
+
+bool frame_queue_try_pop (frame_queue *q, void *item);
+
+void frame_queue_close (frame_queue *q);
+
+// Called by frame_reorder_drain() for each item, in order.
+typedef void (*frame_reorder_write_func)(void *item, size_t index, void *context);
+
+// Bounded buffer that puts items finished out of order back in order. Item i goes in
+// slot i % capacity, whose sequence number is i while it's free for it and i + 1 once
+// it's been put there. Only one thread at a time drains the buffer, writing the items
+// out in order; the others carry on instead of waiting for it.
+typedef struct
+{
+	size_t capacity;
+	size_t item_size;
+	uint8_t *items;
+	size_t *sequence;
+	size_t next;
+	omp_lock_t drain_lock;
+	frame_reorder_write_func write;
+	void *context;
+} frame_reorder_buffer;
+
+void frame_reorder_init (frame_reorder_buffer *rb, size_t capacity, size_t item_size, frame_reorder_write_func write, void *context);
+
+void frame_reorder_free (frame_reorder_buffer *rb);
+
+void frame_reorder_put (frame_reorder_buffer *rb, size_t index, const void *item);
+
+void frame_reorder_drain (frame_reorder_buffer *rb);
+
+#endif
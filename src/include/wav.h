@@ -40,7 +40,7 @@ int64_t wav_get_sizeof(wav_handle *w, int64_t num_samples);
 uint8_t wav_get_num_channels(wav_handle *w, err_t *err_out);
 err_t wav_set_num_channels(wav_handle *w, uint8_t num_channels);
 
-err_t wav_init_ssdpcm(wav_handle *w, wav_sample_fmt format, ssdpcm_block_mode mode, uint16_t block_length, bool has_reference_sample);
+err_t wav_init_ssdpcm(wav_handle *w, wav_sample_fmt format, ssdpcm_block_mode mode, uint16_t block_length, uint8_t reference_interval);
 ssdpcm_block_mode wav_get_ssdpcm_mode(wav_handle *w, err_t *err_out);
 uint16_t wav_get_ssdpcm_block_length(wav_handle *w, err_t *err_out);
 uint16_t wav_get_ssdpcm_total_bytes_per_block(wav_handle *w, err_t *err_out);
@@ -49,6 +49,10 @@ uint8_t wav_get_ssdpcm_num_slopes(wav_handle *w, err_t *err_out);
 err_t wav_write_ssdpcm_block(wav_handle *w, void *reference, void *slopes, void *code, int64_t index, uint16_t channel_idx);
 err_t wav_read_ssdpcm_block(wav_handle *w, void *reference, void *slopes, void *code, uint16_t channel_idx);
 wav_sample_fmt wav_get_ssdpcm_output_format(wav_handle *w, err_t *err_out);
-bool wav_ssdpcm_has_reference_sample_on_every_block(wav_handle *w, err_t *err_out);
+uint8_t wav_get_ssdpcm_reference_interval(wav_handle *w, err_t *err_out);
+bool wav_ssdpcm_frame_has_reference(wav_handle *w, int64_t index);
+int64_t wav_get_ssdpcm_frame_offset(wav_handle *w, int64_t index);
+int64_t wav_get_ssdpcm_num_frames(wav_handle *w, err_t *err_out);
+const uint8_t *wav_map_data(wav_handle *w, err_t *err_out);
 
 #endif
@@ -196,7 +196,7 @@ main (int argc, char **argv)
 			fprintf(stderr, "\rEncoding block %d:%d...", superblock_index, block_count);
 			sample_convert_u8_to_u7(u8_buffer, u8_buffer, block.length);
 			sample_decode_u8(sample_buffer, u8_buffer, block.length);
-			(void) ssdpcm_encode_binary_search(&block, sample_buffer, &sigma);
+			(void) ssdpcm_search_encode(ssdpcm_search_binary_search, &block, sample_buffer, &sigma);
 			
 			for (i = 0; i < block.num_deltas / 2; i++)
 			{
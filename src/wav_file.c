@@ -22,6 +22,8 @@
 #include <limits.h>
 #include <errors.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // TODO!
 
@@ -90,7 +92,7 @@ typedef struct
 	uint8_t num_slopes;
 	uint8_t bits_per_output_sample;
 	uint8_t bytes_per_read_alignment;
-	bool has_reference_sample_on_every_block;
+	uint8_t reference_interval;
 	uint16_t block_length;
 	uint16_t bytes_per_block;
 } wav_ssdpcm_extra_chunk;
@@ -115,6 +117,10 @@ typedef struct
 	bool write_mode;
 	bool no_extra_chunks;
 	bool header_synced;
+	
+	// The whole file mapped to memory by wav_map_data(), if it was.
+	void *mapping;
+	size_t mapping_length;
 } wav_handle;
 
 /**
@@ -192,7 +198,7 @@ wav_read_ssdpcm_extra_chunk_ (wav_handle *w)
 	x = fread(&ssdpcm_ex->num_slopes, sizeof(uint8_t), 1, w->fp);
 	x = x && fread(&ssdpcm_ex->bits_per_output_sample, sizeof(uint8_t), 1, w->fp);
 	x = x && fread(&ssdpcm_ex->bytes_per_read_alignment, sizeof(uint8_t), 1, w->fp);
-	x = x && fread(&ssdpcm_ex->has_reference_sample_on_every_block, 1, 1, w->fp);
+	x = x && fread(&ssdpcm_ex->reference_interval, sizeof(uint8_t), 1, w->fp);
 	x = x && fread(&ssdpcm_ex->block_length, sizeof(uint16_t), 1, w->fp);
 	x = x && fread(&ssdpcm_ex->bytes_per_block, sizeof(uint16_t), 1, w->fp);
 	if (!x)
@@ -694,7 +700,7 @@ wav_write_header (wav_handle *w)
 			fwrite(&ssdpcm_ex->num_slopes, sizeof(uint8_t), 1, w->fp);
 			fwrite(&ssdpcm_ex->bits_per_output_sample, sizeof(uint8_t), 1, w->fp);
 			fwrite(&ssdpcm_ex->bytes_per_read_alignment, sizeof(uint8_t), 1, w->fp);
-			fwrite(&ssdpcm_ex->has_reference_sample_on_every_block, 1, 1, w->fp);
+			fwrite(&ssdpcm_ex->reference_interval, sizeof(uint8_t), 1, w->fp);
 			fwrite(&ssdpcm_ex->block_length, sizeof(uint16_t), 1, w->fp);
 			fwrite(&ssdpcm_ex->bytes_per_block, sizeof(uint16_t), 1, w->fp);
 		}
@@ -824,6 +830,12 @@ wav_close(wav_handle *w, err_t *err_out)
 		w->fp = NULL;
 	}
 	
+	if (w->mapping != NULL)
+	{
+		munmap(w->mapping, w->mapping_length);
+		w->mapping = NULL;
+	}
+	
 	if (w->header != NULL)
 	{
 		if (w->header->fmt_ex_chunk != NULL)
@@ -1208,7 +1220,7 @@ wav_write(wav_handle *w, void *src, size_t num_samples, int64_t offset, err_t *e
 }
 
 err_t
-wav_init_ssdpcm(wav_handle *w, wav_sample_fmt format, ssdpcm_block_mode mode, uint16_t block_length, bool has_reference_sample)
+wav_init_ssdpcm(wav_handle *w, wav_sample_fmt format, ssdpcm_block_mode mode, uint16_t block_length, uint8_t reference_interval)
 {
 	if (w == NULL || w->header == NULL)
 	{
@@ -1260,7 +1272,7 @@ wav_init_ssdpcm(wav_handle *w, wav_sample_fmt format, ssdpcm_block_mode mode, ui
 	}
 
 	ssdpcm_ex->block_length = block_length;
-	ssdpcm_ex->has_reference_sample_on_every_block = has_reference_sample;
+	ssdpcm_ex->reference_interval = reference_interval;
 
 	switch (mode)
 	{
@@ -1311,7 +1323,7 @@ wav_init_ssdpcm(wav_handle *w, wav_sample_fmt format, ssdpcm_block_mode mode, ui
 	}
 
 	w->header->fmt_content.byte_rate = w->header->fmt_content.sample_rate * ssdpcm_ex->bytes_per_block * w->header->fmt_content.num_channels / ssdpcm_ex->block_length;
-	w->header->fmt_content.bytes_per_quantum = (ssdpcm_ex->bytes_per_block + (has_reference_sample ? (ssdpcm_ex->bits_per_output_sample / 8) : 0)) * w->header->fmt_content.num_channels;
+	w->header->fmt_content.bytes_per_quantum = (ssdpcm_ex->bytes_per_block + (reference_interval == 1 ? (ssdpcm_ex->bits_per_output_sample / 8) : 0)) * w->header->fmt_content.num_channels;
 	
 	assert(mode >= 0 && mode < NUM_SSDPCM_MODES);
 	assert(*ssdpcm_mode_fourcc_list[mode] != '\0' || "Unregistered mode fourcc");
@@ -1320,6 +1332,121 @@ wav_init_ssdpcm(wav_handle *w, wav_sample_fmt format, ssdpcm_block_mode mode, ui
 	return E_OK;
 }
 
+/**
+ * Checks if the given SSDPCM frame starts with reference samples: the first frame
+ * always does, and then every reference_interval-th frame if the interval isn't 0.
+ */
+bool
+wav_ssdpcm_frame_has_reference(wav_handle *w, int64_t index)
+{
+	debug_assert(w != NULL);
+	debug_assert(w->header != NULL);
+	debug_assert(w->header->ssdpcm_extra_chunk != NULL);
+	
+	uint8_t interval = w->header->ssdpcm_extra_chunk->reference_interval;
+	return index == 0 || (interval != 0 && index % interval == 0);
+}
+
+/**
+ * Finds the offset of an SSDPCM frame in the data chunk, accounting for the reference
+ * samples of the frames before it.
+ */
+static int64_t
+wav_ssdpcm_frame_offset_ (wav_handle *w, int64_t index)
+{
+	wav_ssdpcm_extra_chunk *ssdpcm_ex = w->header->ssdpcm_extra_chunk;
+	uint16_t num_channels = w->header->fmt_content.num_channels;
+	int64_t frame_size = (int64_t)ssdpcm_ex->bytes_per_block * num_channels;
+	int64_t reference_size = (int64_t)(ssdpcm_ex->bits_per_output_sample / 8) * num_channels;
+	int64_t num_references;
+	
+	if (ssdpcm_ex->reference_interval == 0)
+	{
+		num_references = index > 0 ? 1 : 0;
+	}
+	else
+	{
+		num_references = (index + ssdpcm_ex->reference_interval - 1) / ssdpcm_ex->reference_interval;
+	}
+	return index * frame_size + num_references * reference_size;
+}
+
+/**
+ * Finds the offset of an SSDPCM frame in the data chunk, for accessing frames out of
+ * order through wav_map_data().
+ */
+int64_t
+wav_get_ssdpcm_frame_offset(wav_handle *w, int64_t index)
+{
+	debug_assert(w != NULL);
+	debug_assert(w->header != NULL);
+	debug_assert(w->header->ssdpcm_extra_chunk != NULL);
+	
+	return wav_ssdpcm_frame_offset_(w, index);
+}
+
+/**
+ * Counts the whole SSDPCM frames in the data chunk.
+ */
+int64_t
+wav_get_ssdpcm_num_frames(wav_handle *w, err_t *err_out)
+{
+	if (w == NULL || w->header == NULL)
+	{
+		*err_out = E_NULLPTR;
+		return 0;
+	}
+	if (w->header->ssdpcm_extra_chunk == NULL)
+	{
+		*err_out = E_NOT_A_SSDPCM_WAV;
+		return 0;
+	}
+	
+	wav_ssdpcm_extra_chunk *ssdpcm_ex = w->header->ssdpcm_extra_chunk;
+	uint16_t num_channels = w->header->fmt_content.num_channels;
+	int64_t frame_size = (int64_t)ssdpcm_ex->bytes_per_block * num_channels;
+	int64_t reference_size = (int64_t)(ssdpcm_ex->bits_per_output_sample / 8) * num_channels;
+	int64_t data_length = w->header->data_length;
+	int64_t period, num_frames = 0;
+	
+	*err_out = E_OK;
+	if (ssdpcm_ex->reference_interval != 0)
+	{
+		period = ssdpcm_ex->reference_interval * frame_size + reference_size;
+		num_frames = (data_length / period) * ssdpcm_ex->reference_interval;
+		data_length %= period;
+	}
+	if (data_length >= reference_size)
+	{
+		num_frames += (data_length - reference_size) / frame_size;
+	}
+	return num_frames;
+}
+
+/**
+ * Checks if the file position is at the start of an SSDPCM frame with reference
+ * samples, when reading or writing frames in order.
+ */
+static bool
+wav_ssdpcm_at_reference_ (wav_handle *w)
+{
+	wav_ssdpcm_extra_chunk *ssdpcm_ex = w->header->ssdpcm_extra_chunk;
+	uint16_t num_channels = w->header->fmt_content.num_channels;
+	int64_t offset = wav_tell_bytes(w);
+	int64_t period;
+	
+	if (offset == 0)
+	{
+		return true;
+	}
+	if (ssdpcm_ex->reference_interval == 0)
+	{
+		return false;
+	}
+	period = (int64_t)ssdpcm_ex->reference_interval * ssdpcm_ex->bytes_per_block * num_channels + (ssdpcm_ex->bits_per_output_sample / 8) * num_channels;
+	return offset % period == 0;
+}
+
 err_t
 wav_write_ssdpcm_block(wav_handle *w, void *reference, void *slopes, void *code, int64_t index, uint16_t channel_idx)
 {
@@ -1350,29 +1477,24 @@ wav_write_ssdpcm_block(wav_handle *w, void *reference, void *slopes, void *code,
 	
 	if (index >= 0)
 	{
-		err = wav_seek(w, index, SEEK_SET);
-		if (err != E_OK)
-		{
-			return err;
-		}
+		int64_t offset = wav_ssdpcm_frame_offset_(w, index);
 		if (channel_idx > 0)
 		{
-			int64_t amt_to_seek = ssdpcm_ex->bytes_per_block * channel_idx;
-			if (ssdpcm_ex->has_reference_sample_on_every_block)
-			{
-				amt_to_seek += sample_size_bytes * (num_channels);
-			}
-			err = fseek(w->fp, amt_to_seek, SEEK_CUR);
-			if (err != E_OK)
+			offset += ssdpcm_ex->bytes_per_block * channel_idx;
+			if (wav_ssdpcm_frame_has_reference(w, index))
 			{
-				return err;
+				offset += sample_size_bytes * (num_channels);
 			}
 		}
+		err = fseek(w->fp, w->header->data_offset_in_file + offset, SEEK_SET);
+		if (err != E_OK)
+		{
+			return E_FILE_NOT_SEEKABLE;
+		}
 		initial_offset = wav_tell_bytes(w);
 	}
 	
-	if ((ssdpcm_ex->has_reference_sample_on_every_block && (channel_idx % num_channels) == 0)
-		|| wav_tell_bytes(w) == 0)
+	if ((channel_idx % num_channels) == 0 && wav_ssdpcm_at_reference_(w))
 	{
 		actually_written = fwrite(reference, sample_size_bytes, num_channels, w->fp);
 		if (actually_written != num_channels)
@@ -1454,8 +1576,7 @@ wav_read_ssdpcm_block(wav_handle *w, void *reference, void *slopes, void *code,
 		return E_END_OF_STREAM;
 	}
 	
-	if ((ssdpcm_ex->has_reference_sample_on_every_block && (channel_idx % num_channels) == 0)
-		|| wav_tell_bytes(w) == 0)
+	if ((channel_idx % num_channels) == 0 && wav_ssdpcm_at_reference_(w))
 	{
 		amt_to_read = sample_size_bytes;
 		actually_read = fread(reference, sample_size_bytes, num_channels, w->fp);
@@ -1492,6 +1613,55 @@ wav_read_ssdpcm_block(wav_handle *w, void *reference, void *slopes, void *code,
 	return E_OK;
 }
 
+/**
+ * Maps the whole file to memory, read-only, so that many threads can read from it at
+ * once without going through the file position. Returns a pointer to the start of the
+ * data chunk, which stays valid until the file is closed, or NULL if the file couldn't
+ * be mapped.
+ */
+const uint8_t *
+wav_map_data(wav_handle *w, err_t *err_out)
+{
+	struct stat file_stat;
+	void *mapping;
+	
+	if (w == NULL || w->header == NULL || w->fp == NULL)
+	{
+		*err_out = E_NULLPTR;
+		return NULL;
+	}
+	if (w->write_mode)
+	{
+		*err_out = E_INVALID_ARGUMENT;
+		return NULL;
+	}
+	
+	if (w->mapping == NULL)
+	{
+		if (fstat(fileno(w->fp), &file_stat) != 0)
+		{
+			*err_out = E_READ_ERROR;
+			return NULL;
+		}
+		if ((uint64_t)file_stat.st_size < (uint64_t)w->header->data_offset_in_file + w->header->data_length)
+		{
+			*err_out = E_PREMATURE_END_OF_FILE;
+			return NULL;
+		}
+		mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fileno(w->fp), 0);
+		if (mapping == MAP_FAILED)
+		{
+			*err_out = E_READ_ERROR;
+			return NULL;
+		}
+		w->mapping = mapping;
+		w->mapping_length = file_stat.st_size;
+	}
+	
+	*err_out = E_OK;
+	return (const uint8_t *)w->mapping + w->header->data_offset_in_file;
+}
+
 uint16_t
 wav_get_ssdpcm_block_length(wav_handle *w, err_t *err_out)
 {
@@ -1545,7 +1715,7 @@ wav_get_ssdpcm_code_bytes_per_block(wav_handle *w, err_t *err_out)
 	*err_out = E_OK;
 	wav_ssdpcm_extra_chunk *ssdpcm_ex = w->header->ssdpcm_extra_chunk;
 	size_t sample_size_bytes = ssdpcm_ex->bits_per_output_sample / 8;
-	size_t block_header_data_size = sample_size_bytes * (ssdpcm_ex->num_slopes / 2 + (ssdpcm_ex->has_reference_sample_on_every_block ? 1 : 0));
+	size_t block_header_data_size = sample_size_bytes * (ssdpcm_ex->num_slopes / 2);
 	return ssdpcm_ex->bytes_per_block - block_header_data_size;
 }
 
@@ -1567,8 +1737,8 @@ wav_get_ssdpcm_num_slopes(wav_handle *w, err_t *err_out)
 	return w->header->ssdpcm_extra_chunk->num_slopes;
 }
 
-bool
-wav_ssdpcm_has_reference_sample_on_every_block(wav_handle *w, err_t *err_out)
+uint8_t
+wav_get_ssdpcm_reference_interval(wav_handle *w, err_t *err_out)
 {
 	if (w == NULL || w->header == NULL)
 	{
@@ -1581,7 +1751,8 @@ wav_ssdpcm_has_reference_sample_on_every_block(wav_handle *w, err_t *err_out)
 		return 0;
 	}
 	
-	return w->header->ssdpcm_extra_chunk->has_reference_sample_on_every_block;
+	*err_out = E_OK;
+	return w->header->ssdpcm_extra_chunk->reference_interval;
 }
 
 err_t
@@ -244,7 +244,7 @@ main (int argc, char **argv)
 		}
 		
 		fprintf(stderr, "\rEncoding block %lu...", block_count);
-		(void) ssdpcm_encode_binary_search(&block, sample_buffer, &sigma);
+		(void) ssdpcm_search_encode(ssdpcm_search_binary_search, &block, sample_buffer, &sigma);
 		ssdpcm_block_decode(sample_buffer, &block);
 		temp_last_sample = sample_buffer[block_length - 1];
 		if (comb_filter)